@@ -1,34 +1,138 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <spawn.h>
+#include <signal.h>
 
-#define PROMPT "choong-sh>"
+extern char **environ;
 
-const int CMD_LEN_MAX = 2048;
+#define PROMPT "choong-sh>"
 
 const int ARG_LEN_MAX = 1024;
 const char *ARG_TOK = " ";
-const int ARG_MAX = 100;
 
 const int PATH_LEN_MAX = 1024;
 const char *PATH = "PATH";
 const char *PATH_TOK = ":";
 const char *HOME = "HOME";
+const char *HISTFILE = "CHOONG_HISTFILE";
+const char *HISTFILE_NAME = ".choong_history";
 
 const int TIME_LEN_MAX = 64;
 
+const size_t READ_BLOCK = 65536;
+
+#define HASH_BUCKETS 256
+
+enum launch_method {
+    LAUNCH_FORK = 0,    // fork() + execv()
+    LAUNCH_SPAWN,       // posix_spawn(), does not copy the shell's page tables
+};
+
 static int debug = 1;
+static int interactive = 1;
+static int launcher = LAUNCH_SPAWN;
+static int fastpath = 1;    // run utility builtins instead of programs
+
+// Machine readable per-command stats log
+static FILE *statslog = NULL;
+static int statsjson = 0;
+
+const size_t HIST_CHUNK = 65536;
+
+// History strings are packed into chunks that never move, newest chunk first
+struct hist_chunk {
+    struct hist_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
 
 static int histlen = 0;
 static int histsize = 0;
 static char **history = NULL;
+static struct hist_chunk *histchunks = NULL;
+
+/* Persistent history file, entries from earlier sessions come first. The file and its
+ * offset index (<file>.idx, the end offset of each line) are mapped, not read.
+ */
+static int histfd = -1;
+static const char *histmap = NULL;
+static size_t histmapsize = 0;
+static const uint64_t *histend = NULL;
+static int nfilehist = 0;
+static char *histrun = NULL;    // file entry being rerun, terminated
+static size_t histrunsize = 0;
+
+// Last search, refined queries only check its hits
+static char *lastquery = NULL;
+static int *searchhits = NULL;
+static int nsearchhits = 0;
+static int searchhitsize = 0;
+static int searchedto = 0;      // entries covered by the last search
+
+// Argument arena, reused by every command. Grows to the longest command seen.
+static char *argbuff = NULL;
+static char **args = NULL;
+static char *argop = NULL;
+static size_t argsize = 0;
+
+// Command hash table, name -> resolved path
+struct hash_entry {
+    char *name;
+    char *path;
+    int hits;
+    struct hash_entry *next;
+};
+
+static struct hash_entry *cmdhash[HASH_BUCKETS];
+static char *hashpath = NULL;   // PATH the hash table was filled from
+
+// Background jobs, one per pipeline
+struct job_proc {
+    pid_t pid;
+    char *path;
+    int done;
+    int wstatus;
+    struct rusage usage;
+    double start;
+    double end;
+};
+
+struct job {
+    int id;
+    char *cmd;
+    int nproc;
+    int nleft;
+    struct job_proc *procs;
+};
+
+// Only changed with SIGCHLD blocked, the SIGCHLD handler fills in finished processes
+static struct job *joblist = NULL;
+static int njobs = 0;
+static int jobsize = 0;
+static int nextjob = 1;
+
+double mono_secs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
 
 void timeval_str(struct timeval tv, char *buff){
     time_t nowtime;
@@ -41,15 +145,47 @@ void timeval_str(struct timeval tv, char *buff){
     snprintf(buff, TIME_LEN_MAX, "%s.%06d", tmbuf, tv.tv_usec);
 }
 
-int external(const char *path, char **args){
+/* Start program at resolved path, returns child pid or -1.
+ * in and out replace the child's stdin and stdout when not -1.
+ */
+pid_t launch(const char *path, char **args, int method, int in, int out){
+    pid_t pid;
+
+    // Shell output must come before the child's when stdout is not a terminal
+    fflush(stdout);
+
+    if(method == LAUNCH_SPAWN){
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init(&fa);
+        if(in != -1)
+            posix_spawn_file_actions_adddup2(&fa, in, STDIN_FILENO);
+        if(out != -1)
+            posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO);
+
+        // Spawn process, path is already resolved by search()
+        int err = posix_spawn(&pid, path, &fa, NULL, args, environ);
+        posix_spawn_file_actions_destroy(&fa);
+        if(err != 0){
+            fprintf(stderr, "posix_spawn error %d %s\n", err, strerror(err));
+            return -1;
+        }
+        return pid;
+    }
+
     // Fork process
-    pid_t pid = fork();
+    pid = fork();
 
     if(pid == 0){
-        // Child, execute program
-        int err = execvp(path, args);
+        // Child, set up redirection
+        if(in != -1)
+            dup2(in, STDIN_FILENO);
+        if(out != -1)
+            dup2(out, STDOUT_FILENO);
+
+        // Execute program
+        int err = execv(path, args);
         // we shouldn't be here
-        fprintf(stderr, "execl error %d %d %s\n", err, errno, strerror(errno));
+        fprintf(stderr, "execv error %d %d %s\n", err, errno, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
@@ -59,47 +195,158 @@ int external(const char *path, char **args){
         return -1;
     }
 
-    // Parent
+    return pid;
+}
+
+void print_stats(const char *path, const struct rusage *usage, double wall){
+    printf("** STATS for %s **\n", path);
+
+    printf("wall clock time: %.6f sec\n", wall);
+    printf("user CPU time used: %ld.%06d sec\n", usage->ru_utime.tv_sec, usage->ru_utime.tv_usec);
+    printf("system CPU time used: %ld.%06d sec\n", usage->ru_stime.tv_sec, usage->ru_stime.tv_usec);
+
+    printf("maximum resident set size: %ld kB\n",        usage->ru_maxrss);
+//    printf("integral shared memory size: %ld\n",      usage->ru_ixrss);
+//    printf("integral unshared data size: %ld\n",      usage->ru_idrss);
+//    printf("integral unshared stack size: %ld\n",     usage->ru_isrss);
+    printf("page reclaims (soft page faults): %ld\n", usage->ru_minflt);
+    printf("page faults (hard page faults): %ld\n",   usage->ru_majflt);
+//    printf("swaps: %ld\n",                            usage->ru_nswap);
+    printf("block input operations: %ld\n",           usage->ru_inblock);
+    printf("block output operations: %ld\n",          usage->ru_oublock);
+//    printf("IPC messages sent: %ld\n",                usage->ru_msgsnd);
+//    printf("IPC messages received: %ld\n",            usage->ru_msgrcv);
+//    printf("signals received: %ld\n",                 usage->ru_nsignals);
+    printf("voluntary context switches: %ld\n",       usage->ru_nvcsw);
+    printf("involuntary context switches: %ld\n",     usage->ru_nivcsw);
+}
+
+// Append one record to the stats log
+void log_stats(const char *path, int wstatus, const struct rusage *usage, double wall){
+    struct timeval tv;
+    char timestr[TIME_LEN_MAX];
+    gettimeofday(&tv, NULL);
+    timeval_str(tv, timestr);
+
+    // exit status, or negative signal number
+    int code = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : WIFSIGNALED(wstatus) ? -WTERMSIG(wstatus) : 0;
+
+    if(statsjson){
+        fprintf(statslog, "{\"time\":\"%s\",\"command\":\"", timestr);
+        for(const char *c = path; *c; ++c){
+            if(*c == '"' || *c == '\\')
+                fprintf(statslog, "\\%c", *c);
+            else if((unsigned char)*c < 0x20)
+                fprintf(statslog, "\\u%04x", *c);
+            else
+                fputc(*c, statslog);
+        }
+        fprintf(statslog, "\",\"status\":%d,\"wall\":%.6f,\"utime\":%ld.%06ld,\"stime\":%ld.%06ld,"
+                          "\"maxrss\":%ld,\"minflt\":%ld,\"majflt\":%ld,\"inblock\":%ld,\"oublock\":%ld,"
+                          "\"nvcsw\":%ld,\"nivcsw\":%ld}\n",
+                code, wall,
+                (long)usage->ru_utime.tv_sec, (long)usage->ru_utime.tv_usec,
+                (long)usage->ru_stime.tv_sec, (long)usage->ru_stime.tv_usec,
+                usage->ru_maxrss, usage->ru_minflt, usage->ru_majflt, usage->ru_inblock, usage->ru_oublock,
+                usage->ru_nvcsw, usage->ru_nivcsw);
+    } else {
+        // Quotes in a quoted field are doubled
+        fprintf(statslog, "%s,\"", timestr);
+        for(const char *c = path; *c; ++c){
+            if(*c == '"')
+                fputc('"', statslog);
+            fputc(*c, statslog);
+        }
+        fprintf(statslog, "\",%d,%.6f,%ld.%06ld,%ld.%06ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld\n",
+                code, wall,
+                (long)usage->ru_utime.tv_sec, (long)usage->ru_utime.tv_usec,
+                (long)usage->ru_stime.tv_sec, (long)usage->ru_stime.tv_usec,
+                usage->ru_maxrss, usage->ru_minflt, usage->ru_majflt, usage->ru_inblock, usage->ru_oublock,
+                usage->ru_nvcsw, usage->ru_nivcsw);
+    }
+    fflush(statslog);
+}
+
+// Print and log the stats of one finished child
+void record_stats(const char *path, int wstatus, const struct rusage *usage, double wall){
+    if(debug && WIFEXITED(wstatus))
+        print_stats(path, usage, wall);
+    if(statslog != NULL)
+        log_stats(path, wstatus, usage, wall);
+}
+
+/* Wait for a child started at start, record its stats, returns its exit status.
+ * wait4() gives the usage of this child alone, unlike getrusage(RUSAGE_CHILDREN), which
+ * accumulates every child ever waited for.
+ */
+int reap(pid_t pid, const char *path, double start){
     int wstatus;
-    pid_t wpid = waitpid(pid, &wstatus, 0);
+    struct rusage usage;
+    pid_t wpid = wait4(pid, &wstatus, 0, &usage);
+    double wall = mono_secs() - start;
     if(wpid != pid){
-        fprintf(stderr, "waitpid error %d\n", wpid);
+        fprintf(stderr, "wait4 error %d %s\n", wpid, strerror(errno));
+        return -1;
     }
 
+    record_stats(path, wstatus, &usage, wall);
+
     // capture exit status
     int ret = 0;
-    if(WIFEXITED(wstatus)){
+    if(WIFEXITED(wstatus))
         ret = WEXITSTATUS(wstatus);
-        struct rusage usage;
-        if(getrusage(RUSAGE_CHILDREN, &usage) != 0){
-            fprintf(stderr, "getrusage error %d %s\n", errno, strerror(errno));
-            return ret;
-        }
 
-        if(debug){
-            printf("** STATS for %s **\n", path);
+    return ret;
+}
+
+int external(const char *path, char **args){
+    double start = mono_secs();
+    pid_t pid = launch(path, args, launcher, -1, -1);
+    if(pid == -1)
+        return -1;
+
+    return reap(pid, path, start);
+}
 
-            printf("user CPU time used: %ld.%06d sec\n", usage.ru_utime.tv_sec, usage.ru_utime.tv_usec);
-            printf("system CPU time used: %ld.%06d sec\n", usage.ru_stime.tv_sec, usage.ru_stime.tv_usec);
+unsigned hash_str(const char *str){
+    unsigned hash = 5381;
+    while(*str)
+        hash = hash * 33 + (unsigned char)*str++;
+    return hash % HASH_BUCKETS;
+}
 
-            printf("maximum resident set size: %ld kB\n",        usage.ru_maxrss);
-//            printf("integral shared memory size: %ld\n",      usage.ru_ixrss);
-//            printf("integral unshared data size: %ld\n",      usage.ru_idrss);
-//            printf("integral unshared stack size: %ld\n",     usage.ru_isrss);
-            printf("page reclaims (soft page faults): %ld\n", usage.ru_minflt);
-            printf("page faults (hard page faults): %ld\n",   usage.ru_majflt);
-//            printf("swaps: %ld\n",                            usage.ru_nswap);
-            printf("block input operations: %ld\n",           usage.ru_inblock);
-            printf("block output operations: %ld\n",          usage.ru_oublock);
-//            printf("IPC messages sent: %ld\n",                usage.ru_msgsnd);
-//            printf("IPC messages received: %ld\n",            usage.ru_msgrcv);
-//            printf("signals received: %ld\n",                 usage.ru_nsignals);
-            printf("voluntary context switches: %ld\n",       usage.ru_nvcsw);
-            printf("involuntary context switches: %ld\n",     usage.ru_nivcsw);
+void hash_clear(){
+    for(int i = 0; i < HASH_BUCKETS; ++i){
+        struct hash_entry *ent = cmdhash[i];
+        while(ent != NULL){
+            struct hash_entry *next = ent->next;
+            free(ent->name);
+            free(ent->path);
+            free(ent);
+            ent = next;
         }
+        cmdhash[i] = NULL;
     }
+}
 
-    return ret;
+struct hash_entry *hash_find(const char *name){
+    struct hash_entry *ent = cmdhash[hash_str(name)];
+    while(ent != NULL){
+        if(strcmp(ent->name, name) == 0)
+            return ent;
+        ent = ent->next;
+    }
+    return NULL;
+}
+
+void hash_add(const char *name, const char *path){
+    struct hash_entry *ent = malloc(sizeof(struct hash_entry));
+    unsigned bucket = hash_str(name);
+    ent->name = strdup(name);
+    ent->path = strdup(path);
+    ent->hits = 0;
+    ent->next = cmdhash[bucket];
+    cmdhash[bucket] = ent;
 }
 
 int search(char *name){
@@ -120,6 +367,25 @@ int search(char *name){
         fprintf(stderr, "no PATH\n");
         return -1;
     }
+
+    // Hashed commands are only valid for the PATH they were found in
+    if(hashpath == NULL || strcmp(hashpath, path) != 0){
+        hash_clear();
+        free(hashpath);
+        hashpath = strdup(path);
+    }
+
+    // Check hash table
+    struct hash_entry *ent = hash_find(name);
+    if(ent != NULL){
+        ent->hits++;
+        strcpy(name, ent->path);
+        return 0;
+    }
+    if(strlen(path) >= PATH_LEN_MAX){
+        fprintf(stderr, "PATH is too long\n");
+        return -2;
+    }
     char pathbuff[PATH_LEN_MAX];
     strcpy(pathbuff, path);
 
@@ -141,7 +407,11 @@ int search(char *name){
         // Check path
         int ret = access(program, X_OK);
         if(ret == 0){
-            // Found program
+            // Found program, relative PATH entries change with the working directory
+            if(tok[0] == '/'){
+                hash_add(name, program);
+                hash_find(name)->hits++;
+            }
             strcpy(name, program);
             return 0;
         }
@@ -153,37 +423,1159 @@ int search(char *name){
     return 1;
 }
 
+/* Utility builtins. These behave like the programs of the same name, but run inside the
+ * shell so scripts calling them in bulk pay no search() or process creation. They return an
+ * exit status and write to stdout.
+ */
+int is_utility(const char *cmd){
+    return strcmp(cmd, "test") == 0 || strcmp(cmd, "[") == 0 ||
+           strcmp(cmd, "true") == 0 || strcmp(cmd, "false") == 0 ||
+           strcmp(cmd, "printf") == 0 || strcmp(cmd, "cat") == 0 ||
+           strcmp(cmd, "mkdir") == 0;
+}
+
+int test_unary(const char *op, const char *arg){
+    struct stat st;
+    switch(op[1]){
+        case 'n': return strlen(arg) > 0;
+        case 'z': return strlen(arg) == 0;
+        case 'e': return stat(arg, &st) == 0;
+        case 'f': return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+        case 'd': return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+        case 's': return stat(arg, &st) == 0 && st.st_size > 0;
+        case 'L':
+        case 'h': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+    }
+    return -1;
+}
+
+int test_binary(const char *a, const char *op, const char *b){
+    if(strcmp(op, "=") == 0) return strcmp(a, b) == 0;
+    if(strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+
+    long long x = atoll(a);
+    long long y = atoll(b);
+    if(strcmp(op, "-eq") == 0) return x == y;
+    if(strcmp(op, "-ne") == 0) return x != y;
+    if(strcmp(op, "-lt") == 0) return x < y;
+    if(strcmp(op, "-le") == 0) return x <= y;
+    if(strcmp(op, "-gt") == 0) return x > y;
+    if(strcmp(op, "-ge") == 0) return x >= y;
+    return -1;
+}
+
+// test and [, returns 0 for true, 1 for false, 2 for a bad expression
+int util_test(char **args, int argn){
+    if(strcmp(args[0], "[") == 0){
+        if(strcmp(args[argn - 1], "]") != 0){
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        --argn;
+    }
+    ++args;
+    --argn;
+
+    int negate = 0;
+    if(argn > 0 && strcmp(args[0], "!") == 0){
+        negate = 1;
+        ++args;
+        --argn;
+    }
+
+    int res;
+    if(argn == 0){
+        res = 0;
+    } else if(argn == 1){
+        res = strlen(args[0]) > 0;
+    } else if(argn == 2 && args[0][0] == '-' && strlen(args[0]) == 2){
+        res = test_unary(args[0], args[1]);
+    } else if(argn == 3){
+        res = test_binary(args[0], args[1], args[2]);
+    } else {
+        res = -1;
+    }
+    if(res < 0){
+        fprintf(stderr, "test: bad expression\n");
+        return 2;
+    }
+    return res != negate ? 0 : 1;
+}
+
+// Prints fmt up to its first conversion, expanding escapes, returns the conversion or NULL
+const char *printf_text(const char *fmt){
+    for(; *fmt; ++fmt){
+        if(*fmt == '%'){
+            if(fmt[1] != '%')
+                return fmt;
+            fputc('%', stdout);
+            ++fmt;
+        } else if(*fmt == '\\' && fmt[1]){
+            ++fmt;
+            switch(*fmt){
+                case 'n': fputc('\n', stdout); break;
+                case 't': fputc('\t', stdout); break;
+                case 'r': fputc('\r', stdout); break;
+                case 'a': fputc('\a', stdout); break;
+                case '0': fputc('\0', stdout); break;
+                default: fputc(*fmt, stdout); break;
+            }
+        } else {
+            fputc(*fmt, stdout);
+        }
+    }
+    return NULL;
+}
+
+// printf, the format is reused until all arguments are consumed
+int util_printf(char **args, int argn){
+    if(argn < 2){
+        fprintf(stderr, "printf: missing format\n");
+        return 2;
+    }
+    const char *fmt = args[1];
+    int next = 2;
+
+    do {
+        int used = 0;
+        const char *p = fmt;
+        while((p = printf_text(p)) != NULL){
+            // Copy one conversion spec, flags, width and precision included, leaving room
+            // for the "ll" length modifier, the conversion and the terminator
+            char spec[32];
+            size_t n = strspn(p + 1, "-+ #0123456789.");
+            if(n + 5 > sizeof(spec) || p[n + 1] == 0){
+                fprintf(stderr, "printf: bad format\n");
+                return 1;
+            }
+            memcpy(spec, p, n + 1);
+            char conv = p[n + 1];
+            const char *arg = next < argn ? args[next++] : NULL;
+            used |= arg != NULL;
+
+            switch(conv){
+                case 'd':
+                case 'i':
+                    strcpy(spec + n + 1, "lld");
+                    printf(spec, arg ? strtoll(arg, NULL, 0) : 0LL);
+                    break;
+                case 'u':
+                case 'x':
+                case 'X':
+                case 'o':
+                    spec[n + 1] = 'l';
+                    spec[n + 2] = 'l';
+                    spec[n + 3] = conv;
+                    spec[n + 4] = 0;
+                    printf(spec, arg ? strtoull(arg, NULL, 0) : 0ULL);
+                    break;
+                case 'f':
+                case 'e':
+                case 'g':
+                    spec[n + 1] = conv;
+                    spec[n + 2] = 0;
+                    printf(spec, arg ? strtod(arg, NULL) : 0.0);
+                    break;
+                case 'c':
+                    if(arg && arg[0])
+                        fputc(arg[0], stdout);
+                    break;
+                case 's':
+                    spec[n + 1] = 's';
+                    spec[n + 2] = 0;
+                    printf(spec, arg ? arg : "");
+                    break;
+                default:
+                    fprintf(stderr, "printf: bad conversion %%%c\n", conv);
+                    return 1;
+            }
+            p += n + 2;
+        }
+        // A format without conversions is printed once
+        if(!used)
+            break;
+    } while(next < argn);
+
+    fflush(stdout);
+    return 0;
+}
+
+// Copy all of in to out in the kernel where possible
+int copy_fd(int in, int out){
+    int method = 0;     // copy_file_range(), then sendfile(), then read() and write()
+    char buf[READ_BLOCK];
+    while(1){
+        ssize_t n;
+        if(method == 0){
+            n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+        } else if(method == 1){
+            n = sendfile(out, in, NULL, 1 << 30);
+        } else {
+            n = read(in, buf, sizeof(buf));
+            if(n > 0){
+                for(ssize_t w = 0; w < n;){
+                    ssize_t k = write(out, buf + w, n - w);
+                    if(k < 0){
+                        if(errno == EINTR)
+                            continue;
+                        return -1;
+                    }
+                    w += k;
+                }
+            }
+        }
+
+        if(n == 0)
+            return 0;
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            // Not supported between these files, try the next method
+            if(method < 2 && (errno == EINVAL || errno == EXDEV || errno == EBADF ||
+                              errno == ENOSYS || errno == EOPNOTSUPP)){
+                ++method;
+                continue;
+            }
+            return -1;
+        }
+    }
+}
+
+int util_cat(char **args, int argn){
+    fflush(stdout);
+    int ret = 0;
+    for(int i = 1; i < argn || i == 1; ++i){
+        int in = STDIN_FILENO;
+        const char *name = i < argn ? args[i] : "-";
+        if(strcmp(name, "-") != 0){
+            in = open(name, O_RDONLY | O_CLOEXEC);
+            if(in == -1){
+                fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+                ret = 1;
+                continue;
+            }
+        }
+        if(copy_fd(in, STDOUT_FILENO) != 0){
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            ret = 1;
+        }
+        if(in != STDIN_FILENO)
+            close(in);
+    }
+    return ret;
+}
+
+int util_mkdir(char **args, int argn){
+    int parents = 0;
+    int ret = 0;
+    for(int i = 1; i < argn; ++i){
+        if(strcmp(args[i], "-p") == 0){
+            parents = 1;
+            continue;
+        }
+
+        if(parents){
+            if(args[i][0] == 0){
+                fprintf(stderr, "mkdir: %s\n", strerror(ENOENT));
+                ret = 1;
+                continue;
+            }
+            // Create each missing component, existing directories are fine
+            char path[strlen(args[i]) + 1];
+            strcpy(path, args[i]);
+            for(char *p = path[0] == '/' ? path + 1 : path; ; ++p){
+                if(*p != '/' && *p != 0)
+                    continue;
+                char c = *p;
+                *p = 0;
+                struct stat st;
+                if(mkdir(path, 0777) != 0 && !(errno == EEXIST && stat(path, &st) == 0 && S_ISDIR(st.st_mode))){
+                    fprintf(stderr, "mkdir: %s: %s\n", path, strerror(errno));
+                    ret = 1;
+                    break;
+                }
+                *p = c;
+                if(c == 0)
+                    break;
+            }
+        } else if(mkdir(args[i], 0777) != 0){
+            fprintf(stderr, "mkdir: %s: %s\n", args[i], strerror(errno));
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+int utility(char **args, int argn){
+    const char *cmd = args[0];
+    if(strcmp(cmd, "true") == 0)
+        return 0;
+    if(strcmp(cmd, "false") == 0)
+        return 1;
+    if(strcmp(cmd, "printf") == 0)
+        return util_printf(args, argn);
+    if(strcmp(cmd, "cat") == 0)
+        return util_cat(args, argn);
+    if(strcmp(cmd, "mkdir") == 0)
+        return util_mkdir(args, argn);
+    return util_test(args, argn);
+}
+
+/* Launch a program n times with each launch method, print commands per second. Utilities
+ * are also run n times as builtins, path is NULL if there is only the builtin.
+ */
+void bench_launch(int n, const char *path, char **args, int argn){
+    const char *names[] = { "fork", "spawn" };
+    for(int method = LAUNCH_FORK; path != NULL && method <= LAUNCH_SPAWN; ++method){
+        double start = mono_secs();
+        int count = 0;
+        for(int i = 0; i < n; ++i){
+            pid_t pid = launch(path, args, method, -1, -1);
+            if(pid == -1)
+                break;
+            waitpid(pid, NULL, 0);
+            ++count;
+        }
+        double secs = mono_secs() - start;
+        printf("%s: %d commands in %.6f sec, %.1f commands/sec\n", names[method], count, secs, count / secs);
+    }
+
+    if(is_utility(args[0])){
+        double start = mono_secs();
+        for(int i = 0; i < n; ++i)
+            utility(args, argn);
+        double secs = mono_secs() - start;
+        printf("builtin: %d commands in %.6f sec, %.1f commands/sec\n", n, secs, n / secs);
+    }
+}
+
+/* Write all of buf to fd. Output to a pipe is spliced in by reference with vmsplice(), so
+ * buf must come from output_alloc() and must not be written to afterwards.
+ */
+int output_write(int fd, char *buf, size_t len){
+    struct stat st;
+    int pipe = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+
+    while(len > 0){
+        ssize_t n;
+        if(pipe){
+            struct iovec iov = { buf, len };
+            n = vmsplice(fd, &iov, 1, 0);
+            if(n < 0 && errno == EINVAL){
+                // Not spliceable after all, copy instead
+                pipe = 0;
+                continue;
+            }
+        } else {
+            n = write(fd, buf, len);
+        }
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Page aligned buffer for builtin output, so its pages can be spliced into a pipe
+char *output_alloc(size_t size){
+    char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return buf == MAP_FAILED ? NULL : buf;
+}
+
+int is_output_builtin(const char *cmd){
+    return strcmp(cmd, "echo") == 0 || strcmp(cmd, "pwd") == 0;
+}
+
+/* Run an output-only builtin as a pipeline stage. Output is built directly in its own pages
+ * and handed to the pipe without being copied through a user buffer again.
+ */
+void output_builtin(char **args, int out){
+    size_t size = PATH_LEN_MAX + 1;
+    if(strcmp(args[0], "echo") == 0){
+        size = 2;
+        for(int i = 1; args[i] != NULL; ++i)
+            size += strlen(args[i]) + 1;
+    }
+
+    char *buf = output_alloc(size);
+    if(buf == NULL){
+        fprintf(stderr, "mmap error %d %s\n", errno, strerror(errno));
+        return;
+    }
+
+    size_t len = 0;
+    if(strcmp(args[0], "echo") == 0){
+        // Same output as the echo builtin
+        for(int i = 1; args[i] != NULL; ++i){
+            size_t alen = strlen(args[i]);
+            memcpy(buf + len, args[i], alen);
+            len += alen;
+            buf[len++] = ' ';
+        }
+    } else {
+        if(getcwd(buf, PATH_LEN_MAX) != NULL)
+            len = strlen(buf);
+    }
+    buf[len++] = '\n';
+
+    if(out == -1){
+        fwrite(buf, 1, len, stdout);
+        fflush(stdout);
+    } else if(output_write(out, buf, len) != 0 && errno != EPIPE){
+        fprintf(stderr, "write error %d %s\n", errno, strerror(errno));
+    }
+
+    // Spliced pages stay referenced by the pipe after unmapping
+    munmap(buf, size);
+}
+
+struct stage {
+    char **args;
+    char *path;
+    int builtin;
+    const char *infile;
+    const char *outfile;
+    int append;
+    int in;
+    int out;
+    pid_t pid;
+    double start;
+};
+
+// Pipeline stages, reused by every pipeline
+static struct stage *stagebuf = NULL;
+static int stagesize = 0;
+
+void add_job(const char *cmd, struct stage *stages, int nstage);
+
+/* Run a pipeline with redirections. args is compacted in place into NULL terminated argument
+ * lists for each stage. All external stages are started before builtin stages write, and the
+ * shell keeps no pipe ends open, so every stage runs concurrently. Builtin stages only skip
+ * process creation in the foreground when they write to the terminal or a file.
+ */
+int pipeline(char **args, const char *argop, int argn, int background, const char *input, int *status){
+    int nstage = 0;
+    int ret = 0;
+    int w = 0;
+
+    // There are fewer stages than arguments
+    if(argn > stagesize){
+        stagesize = argn;
+        stagebuf = realloc(stagebuf, stagesize * sizeof(struct stage));
+    }
+    struct stage *stages = stagebuf;
+
+    // Split stages and collect redirections
+    stages[0].args = args;
+    stages[0].infile = stages[0].outfile = NULL;
+    stages[0].append = 0;
+    for(int i = 0; i < argn; ++i){
+        if(argop[i] == 0){
+            args[w++] = args[i];
+        } else if(argop[i] == '&'){
+            fprintf(stderr, "syntax error near &\n");
+            *status = 4;
+            return -1;
+        } else if(argop[i] == '|'){
+            if(w == stages[nstage].args - args){
+                fprintf(stderr, "syntax error near |\n");
+                *status = 4;
+                return -1;
+            }
+            args[w++] = NULL;
+            ++nstage;
+            stages[nstage].args = args + w;
+            stages[nstage].infile = stages[nstage].outfile = NULL;
+            stages[nstage].append = 0;
+        } else {
+            if(i + 1 >= argn || argop[i + 1] != 0){
+                fprintf(stderr, "syntax error, missing file for %s\n", args[i]);
+                *status = 4;
+                return -1;
+            }
+            if(argop[i] == '<'){
+                stages[nstage].infile = args[i + 1];
+            } else {
+                stages[nstage].outfile = args[i + 1];
+                stages[nstage].append = argop[i] == 'a';
+            }
+            ++i;
+        }
+    }
+    if(w == stages[nstage].args - args){
+        fprintf(stderr, "syntax error, empty command\n");
+        *status = 4;
+        return -1;
+    }
+    args[w] = NULL;
+    ++nstage;
+
+    // Resolve programs
+    for(int k = 0; k < nstage; ++k){
+        struct stage *st = &stages[k];
+        st->in = st->out = -1;
+        st->pid = -1;
+        st->path = NULL;
+        st->builtin = is_output_builtin(st->args[0]);
+    }
+    for(int k = 0; k < nstage; ++k){
+        struct stage *st = &stages[k];
+        if(st->builtin)
+            continue;
+        char path[PATH_LEN_MAX];
+        if(strlen(st->args[0]) >= PATH_LEN_MAX){
+            fprintf(stderr, "path is too long\n");
+            *status = 4;
+            ret = -1;
+            goto out;
+        }
+        strcpy(path, st->args[0]);
+        int stat = search(path);
+        if(stat != 0){
+            if(stat > 0)
+                printf("Unknown Command: %s\n", st->args[0]);
+            *status = 4;
+            ret = -1;
+            goto out;
+        }
+        st->path = strdup(path);
+    }
+
+    // Open redirections and pipes, all close-on-exec so children only see stdin and stdout
+    int err = 0;
+    for(int k = 0; k < nstage && !err; ++k){
+        struct stage *st = &stages[k];
+        if(st->infile != NULL){
+            if(st->in != -1)
+                close(st->in);
+            st->in = open(st->infile, O_RDONLY | O_CLOEXEC);
+            if(st->in == -1){
+                fprintf(stderr, "%s: %s\n", st->infile, strerror(errno));
+                err = 1;
+                break;
+            }
+        }
+        if(k + 1 < nstage){
+            int fds[2];
+            if(pipe2(fds, O_CLOEXEC) != 0){
+                fprintf(stderr, "pipe error %d %s\n", errno, strerror(errno));
+                err = 1;
+                break;
+            }
+            st->out = fds[1];
+            stages[k + 1].in = fds[0];
+        }
+        if(st->outfile != NULL){
+            if(st->out != -1)
+                close(st->out);
+            int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (st->append ? O_APPEND : O_TRUNC);
+            st->out = open(st->outfile, flags, 0644);
+            if(st->out == -1){
+                fprintf(stderr, "%s: %s\n", st->outfile, strerror(errno));
+                err = 1;
+                break;
+            }
+        }
+    }
+
+    // Start all external stages, closing the shell's copies of their descriptors
+    fflush(stdout);
+    for(int k = 0; k < nstage && !err; ++k){
+        struct stage *st = &stages[k];
+        if(st->builtin)
+            continue;
+        st->start = mono_secs();
+        st->pid = launch(st->path, st->args, launcher, st->in, st->out);
+        if(st->in != -1)
+            close(st->in);
+        if(st->out != -1)
+            close(st->out);
+        st->in = st->out = -1;
+    }
+
+    /* Builtin stages write their output while the rest of the pipeline runs. One feeding a
+     * pipe runs in a child, since the shell would block on a full pipe that is read by a
+     * builtin, or by nobody yet. The child keeps only its output, so readers see its end.
+     * Background builtins run in a child too, so the job has a process to wait for.
+     */
+    for(int k = 0; k < nstage; ++k){
+        struct stage *st = &stages[k];
+        if(st->builtin && !err){
+            if(background || (k + 1 < nstage && st->outfile == NULL)){
+                st->start = mono_secs();
+                st->pid = fork();
+                if(st->pid == 0){
+                    for(int j = k; j < nstage; ++j){
+                        if(stages[j].in != -1)
+                            close(stages[j].in);
+                        if(j != k && stages[j].out != -1)
+                            close(stages[j].out);
+                    }
+                    output_builtin(st->args, st->out);
+                    _exit(0);
+                }
+                if(st->pid == -1)
+                    fprintf(stderr, "fork error %d %s\n", errno, strerror(errno));
+            } else {
+                output_builtin(st->args, st->out);
+            }
+        }
+        if(st->in != -1)
+            close(st->in);
+        if(st->out != -1)
+            close(st->out);
+        st->in = st->out = -1;
+    }
+
+    if(background && !err){
+        // Leave the stages running, the SIGCHLD handler collects them
+        add_job(input, stages, nstage);
+        goto out;
+    }
+
+    // Wait for every external stage, the pipeline returns the last stage's status
+    *status = 3;
+    for(int k = 0; k < nstage; ++k){
+        if(stages[k].pid != -1)
+            ret = reap(stages[k].pid, stages[k].path ? stages[k].path : stages[k].args[0], stages[k].start);
+        else
+            ret = stages[k].builtin ? 0 : -1;
+    }
+    if(err)
+        *status = 4;
+
+out:
+    for(int k = 0; k < nstage; ++k)
+        free(stages[k].path);
+    return ret;
+}
+
+// Collect finished background processes and their resource usage, without blocking
+void reap_jobs(){
+    for(int j = 0; j < njobs; ++j){
+        struct job *job = &joblist[j];
+        for(int p = 0; p < job->nproc; ++p){
+            struct job_proc *proc = &job->procs[p];
+            if(proc->done)
+                continue;
+            if(wait4(proc->pid, &proc->wstatus, WNOHANG, &proc->usage) == proc->pid){
+                proc->done = 1;
+                proc->end = mono_secs();
+                job->nleft--;
+            }
+        }
+    }
+}
+
+void sigchld_handler(int sig){
+    (void) sig;
+    int err = errno;
+    reap_jobs();
+    errno = err;
+}
+
+void block_sigchld(sigset_t *old){
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, old);
+}
+
+// Register a started pipeline as a background job
+void add_job(const char *cmd, struct stage *stages, int nstage){
+    sigset_t old;
+    block_sigchld(&old);
+
+    if(njobs + 1 > jobsize){
+        jobsize = jobsize + 16;
+        joblist = realloc(joblist, jobsize * sizeof(struct job));
+    }
+    if(njobs == 0)
+        nextjob = 1;
+
+    struct job *job = &joblist[njobs++];
+    job->id = nextjob++;
+    job->cmd = strdup(cmd);
+    job->nproc = nstage;
+    job->nleft = 0;
+    job->procs = calloc(nstage, sizeof(struct job_proc));
+    for(int k = 0; k < nstage; ++k){
+        struct job_proc *proc = &job->procs[k];
+        proc->pid = stages[k].pid;
+        proc->start = stages[k].start;
+        proc->path = stages[k].path ? strdup(stages[k].path) : strdup(stages[k].args[0]);
+        proc->done = proc->pid == -1;
+        if(!proc->done)
+            job->nleft++;
+    }
+
+    printf("[%d] %d\n", job->id, job->procs[nstage - 1].pid);
+
+    // Children that exited before being registered were ignored by the handler
+    reap_jobs();
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+struct job *find_job(int id){
+    for(int j = 0; j < njobs; ++j){
+        if(joblist[j].id == id)
+            return &joblist[j];
+    }
+    return NULL;
+}
+
+// Report and remove finished background jobs. Call with SIGCHLD blocked.
+void notify_jobs_locked(){
+    int w = 0;
+    for(int j = 0; j < njobs; ++j){
+        struct job *job = &joblist[j];
+        if(job->nleft > 0){
+            joblist[w++] = *job;
+            continue;
+        }
+
+        int wstatus = job->procs[job->nproc - 1].wstatus;
+        printf("[%d] Done (%d)\t%s\n", job->id, WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1, job->cmd);
+        for(int p = 0; p < job->nproc; ++p){
+            struct job_proc *proc = &job->procs[p];
+            if(proc->pid != -1)
+                record_stats(proc->path, proc->wstatus, &proc->usage, proc->end - proc->start);
+            free(job->procs[p].path);
+        }
+        free(job->procs);
+        free(job->cmd);
+    }
+    njobs = w;
+}
+
+void notify_jobs(){
+    sigset_t old;
+    block_sigchld(&old);
+    notify_jobs_locked();
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// Wait for one background job, or all of them when id is 0
+int wait_jobs(int id){
+    sigset_t old;
+    block_sigchld(&old);
+
+    if(id != 0 && find_job(id) == NULL){
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        printf("wait: no job %d\n", id);
+        return -1;
+    }
+
+    while(1){
+        int running = 0;
+        for(int j = 0; j < njobs; ++j){
+            if((id == 0 || joblist[j].id == id) && joblist[j].nleft > 0)
+                running = 1;
+        }
+        if(!running)
+            break;
+        // Atomically unblock SIGCHLD and wait for it
+        sigsuspend(&old);
+    }
+
+    notify_jobs_locked();
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+void add_usage(struct rusage *total, const struct rusage *usage){
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if(usage->ru_maxrss > total->ru_maxrss)
+        total->ru_maxrss = usage->ru_maxrss;
+    total->ru_minflt += usage->ru_minflt;
+    total->ru_majflt += usage->ru_majflt;
+    total->ru_inblock += usage->ru_inblock;
+    total->ru_oublock += usage->ru_oublock;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+struct fan_job {
+    pid_t pid;
+    int out;
+    double start;
+};
+
+/* Run path once per input with at most nproc running at once. Each job writes its stdout into
+ * its own memfd, which is copied out whole when the job finishes, so job output never
+ * interleaves. stderr is not captured and goes straight to the terminal. Every argument of {}
+ * is replaced by the input, otherwise the input is appended. Returns the number of jobs that
+ * failed.
+ */
+int fanout(const char *path, char **args, int argn, char **inputs, int ninput, int nproc){
+    // More slots than inputs would never be used
+    if(nproc > ninput)
+        nproc = ninput;
+    struct fan_job *running = malloc(nproc * sizeof(struct fan_job));
+    int nrunning = 0;
+    int next = 0;
+    int failed = 0;
+
+    // Argument list for each job, the input goes in every marked slot
+    char *argv[argn + 2];
+    int slots[argn + 1];
+    int nslot = 0;
+    for(int i = 0; i < argn; ++i){
+        argv[i] = args[i];
+        if(strcmp(args[i], "{}") == 0)
+            slots[nslot++] = i;
+    }
+    if(nslot == 0)
+        slots[nslot++] = argn;
+    argv[argn] = NULL;
+    argv[argn + 1] = NULL;
+
+    struct rusage total;
+    memset(&total, 0, sizeof(total));
+    double start = mono_secs();
+    fflush(stdout);
+
+    while(next < ninput || nrunning > 0){
+        // Fill free slots
+        while(next < ninput && nrunning < nproc){
+            struct fan_job *job = &running[nrunning];
+            job->out = memfd_create("fanout", MFD_CLOEXEC);
+            if(job->out == -1){
+                fprintf(stderr, "memfd error %d %s\n", errno, strerror(errno));
+                next = ninput;
+                break;
+            }
+            for(int i = 0; i < nslot; ++i)
+                argv[slots[i]] = inputs[next];
+            ++next;
+            job->start = mono_secs();
+            job->pid = launch(path, argv, launcher, -1, job->out);
+            if(job->pid == -1){
+                close(job->out);
+                ++failed;
+                continue;
+            }
+            ++nrunning;
+        }
+
+        // Collect finished jobs, only our own children are waited for
+        sigset_t old;
+        block_sigchld(&old);
+        int done = 0;
+        while(nrunning > 0 && !done){
+            for(int k = 0; k < nrunning; ++k){
+                struct fan_job *job = &running[k];
+                int wstatus;
+                struct rusage usage;
+                if(wait4(job->pid, &wstatus, WNOHANG, &usage) != job->pid)
+                    continue;
+                double wall = mono_secs() - job->start;
+
+                // Output of the whole job, then its stats
+                fflush(stdout);
+                lseek(job->out, 0, SEEK_SET);
+                copy_fd(job->out, STDOUT_FILENO);
+                close(job->out);
+                record_stats(path, wstatus, &usage, wall);
+                add_usage(&total, &usage);
+                if(!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+                    ++failed;
+
+                running[k--] = running[--nrunning];
+                done = 1;
+            }
+            if(!done)
+                sigsuspend(&old);
+        }
+        sigprocmask(SIG_SETMASK, &old, NULL);
+    }
+
+    if(debug){
+        char name[strlen(path) + 32];
+        sprintf(name, "%d jobs of %s", ninput, path);
+        print_stats(name, &total, mono_secs() - start);
+    }
+    free(running);
+    return failed;
+}
+
+/* Opens the history file and maps it with its index. Only lines not yet in the index are
+ * scanned, so startup does not depend on how much history there is.
+ */
+int hist_open(const char *path){
+    histfd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if(histfd == -1){
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char idxpath[strlen(path) + 5];
+    sprintf(idxpath, "%s.idx", path);
+    int idxfd = open(idxpath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(idxfd == -1){
+        fprintf(stderr, "%s: %s\n", idxpath, strerror(errno));
+        close(histfd);
+        histfd = -1;
+        return -1;
+    }
+    // Other shells may be starting up with the same file
+    flock(idxfd, LOCK_EX);
+
+    struct stat st;
+    fstat(histfd, &st);
+    size_t size = st.st_size;
+    if(size > 0){
+        // Terminate a line left unfinished by a crash
+        char c;
+        if(pread(histfd, &c, 1, size - 1) == 1 && c != '\n' && write(histfd, "\n", 1) == 1)
+            ++size;
+    }
+
+    fstat(idxfd, &st);
+    size_t n = st.st_size / sizeof(uint64_t);
+    uint64_t last = 0;
+    if(n > 0 && pread(idxfd, &last, sizeof(last), (n - 1) * sizeof(uint64_t)) != sizeof(last))
+        n = 0;
+    if(last > size){
+        // History file was truncated or replaced, rebuild the index
+        n = 0;
+        last = 0;
+    }
+    int ok = 1;
+    if((size_t)st.st_size != n * sizeof(uint64_t))
+        ok = ftruncate(idxfd, n * sizeof(uint64_t)) == 0;
+
+    if(ok && size > last){
+        // Index lines appended since the index was last updated
+        char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, histfd, 0);
+        if(map != MAP_FAILED){
+            uint64_t ends[1024];
+            int k = 0;
+            const char *p = map + last;
+            const char *end = map + size;
+            const char *nl;
+            while((nl = memchr(p, '\n', end - p)) != NULL){
+                ends[k++] = nl - map + 1;
+                if(k == 1024){
+                    if(pwrite(idxfd, ends, sizeof(ends), n * sizeof(uint64_t)) != sizeof(ends)){
+                        ok = 0;
+                        break;
+                    }
+                    n += k;
+                    k = 0;
+                }
+                p = nl + 1;
+            }
+            if(ok && pwrite(idxfd, ends, k * sizeof(uint64_t), n * sizeof(uint64_t)) != (ssize_t)(k * sizeof(uint64_t)))
+                ok = 0;
+            n += k;
+            last = p - map;
+            munmap(map, size);
+        }
+    }
+    if(!ok){
+        // A partly written index would look valid, so drop it and rebuild it next time
+        fprintf(stderr, "%s: index update failed\n", idxpath);
+        if(ftruncate(idxfd, 0) != 0)
+            unlink(idxpath);
+        n = 0;
+    }
+    flock(idxfd, LOCK_UN);
+
+    if(n > 0){
+        void *idx = mmap(NULL, n * sizeof(uint64_t), PROT_READ, MAP_SHARED, idxfd, 0);
+        void *map = mmap(NULL, last, PROT_READ, MAP_SHARED, histfd, 0);
+        if(idx != MAP_FAILED && map != MAP_FAILED){
+            histend = idx;
+            histmap = map;
+            histmapsize = last;
+            nfilehist = n;
+        } else {
+            fprintf(stderr, "history mmap error %d %s\n", errno, strerror(errno));
+            if(idx != MAP_FAILED)
+                munmap(idx, n * sizeof(uint64_t));
+            if(map != MAP_FAILED)
+                munmap(map, last);
+        }
+    }
+    close(idxfd);
+    return 0;
+}
+
+void hist_close(){
+    if(histend != NULL)
+        munmap((void *)histend, nfilehist * sizeof(uint64_t));
+    if(histmap != NULL)
+        munmap((void *)histmap, histmapsize);
+    if(histfd != -1)
+        close(histfd);
+}
+
+int hist_count(){
+    return nfilehist + histlen;
+}
+
+// Returns history entry i, entries from the file are not terminated
+const char *hist_get(int i, size_t *len){
+    if(i < nfilehist){
+        size_t start = i > 0 ? histend[i - 1] : 0;
+        *len = histend[i] - start - 1;
+        return histmap + start;
+    }
+    const char *cmd = history[i - nfilehist];
+    *len = strlen(cmd);
+    return cmd;
+}
+
+// Returns history entry i as a string that stays valid until the next call
+const char *hist_str(int i){
+    if(i >= nfilehist)
+        return history[i - nfilehist];
+    size_t len;
+    const char *cmd = hist_get(i, &len);
+    if(len + 1 > histrunsize){
+        histrunsize = len + 1;
+        histrun = realloc(histrun, histrunsize);
+    }
+    memcpy(histrun, cmd, len);
+    histrun[len] = 0;
+    return histrun;
+}
+
+// Returns the file entry containing byte offset off
+int hist_entry_at(size_t off){
+    int lo = 0;
+    int hi = nfilehist - 1;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(histend[mid] <= off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void search_hit(int i){
+    if(nsearchhits + 1 > searchhitsize){
+        searchhitsize = searchhitsize ? searchhitsize * 2 : 64;
+        searchhits = realloc(searchhits, searchhitsize * sizeof(int));
+    }
+    searchhits[nsearchhits++] = i;
+}
+
+/* Finds history entries containing query. A query that contains the last query only
+ * rechecks the last hits and entries added since, so typing a search out costs little.
+ */
+void search_history(const char *query){
+    size_t qlen = strlen(query);
+    int count = hist_count();
+    int from = 0;
+
+    if(lastquery != NULL && strstr(query, lastquery) != NULL){
+        // Refine the last hits
+        int n = 0;
+        for(int k = 0; k < nsearchhits; ++k){
+            size_t len;
+            const char *cmd = hist_get(searchhits[k], &len);
+            if(memmem(cmd, len, query, qlen) != NULL)
+                searchhits[n++] = searchhits[k];
+        }
+        nsearchhits = n;
+        from = searchedto;
+    } else {
+        nsearchhits = 0;
+        if(nfilehist > 0 && qlen > 0){
+            // Search the whole file map at once, the index maps hits back to entries.
+            // Queries have no newlines, so a hit never spans entries.
+            const char *p = histmap;
+            const char *end = histmap + histmapsize;
+            while((p = memmem(p, end - p, query, qlen)) != NULL){
+                int i = hist_entry_at(p - histmap);
+                search_hit(i);
+                p = histmap + histend[i];
+            }
+            from = nfilehist;
+        }
+    }
+
+    for(int i = from; i < count; ++i){
+        size_t len;
+        const char *cmd = hist_get(i, &len);
+        if(memmem(cmd, len, query, qlen) != NULL)
+            search_hit(i);
+    }
+    searchedto = count;
+    free(lastquery);
+    lastquery = strdup(query);
+
+    for(int k = 0; k < nsearchhits; ++k){
+        size_t len;
+        const char *cmd = hist_get(searchhits[k], &len);
+        printf("%d\t%.*s\n", searchhits[k], (int)len, cmd);
+    }
+}
+
 void add_history(const char *cmd){
     if(histlen + 1 > histsize){
-        histsize = histsize + 100;
-        // New buffer
-        char **tmp = malloc(histsize * sizeof(const char *));
-        // Copy
-        for(int i = 0; i < histlen; ++i){
-            tmp[i] = history[i];
-        }
-        free(history);
-        history = tmp;
+        histsize = histsize ? histsize * 2 : 128;
+        history = realloc(history, histsize * sizeof(char *));
     }
 
-    // Store command
-    char *stor = malloc(strlen(cmd)+1);
-    strcpy(stor, cmd);
+    // Store command in the newest chunk, or start a new one
+    size_t len = strlen(cmd) + 1;
+    if(histchunks == NULL || histchunks->size - histchunks->used < len){
+        size_t size = len > HIST_CHUNK ? len : HIST_CHUNK;
+        struct hist_chunk *chunk = malloc(sizeof(struct hist_chunk) + size);
+        chunk->next = histchunks;
+        chunk->used = 0;
+        chunk->size = size;
+        histchunks = chunk;
+    }
+    char *stor = histchunks->data + histchunks->used;
+    memcpy(stor, cmd, len);
+    histchunks->used += len;
     history[histlen++] = stor;
+
+    if(histfd != -1){
+        // One append per command, so shells sharing the file do not interleave lines
+        struct iovec iov[2] = {
+            { (void *)cmd, len - 1 },
+            { "\n", 1 },
+        };
+        writev(histfd, iov, 2);
+    }
 }
 
 int process(const char *input, int *status){
     *status = 0;
     if(strlen(input) == 0) return 0;
 
-    char argbuff[CMD_LEN_MAX];
-    strcpy(argbuff, input);
+    /* Every argument takes at least one character of input, so the arena needs at most one
+     * argument slot per character plus the terminator. History commands rerun by !! and !n
+     * reuse the arena only after this command is done with it.
+     */
+    size_t len = strlen(input);
+    if(len + 1 > argsize){
+        argsize = len + 1 > 2 * argsize ? len + 1 : 2 * argsize;
+        argbuff = realloc(argbuff, argsize);
+        args = realloc(args, argsize * sizeof(char *));
+        argop = realloc(argop, argsize);
+    }
+    memcpy(argbuff, input, len + 1);
 
     int argn = 0;
-    char *args[ARG_MAX];
+    int nops = 0;
 
     // Split arguments
-    unsigned int len = strlen(argbuff);
     char *base = argbuff;
     int quote = 0;
 
@@ -196,6 +1588,7 @@ int process(const char *input, int *status){
                 base = argbuff + i + 1;  // Set next arg base
             } else {
                 argbuff[i] = 0;          // Insert terminator
+                argop[argn] = 0;
                 args[argn++] = base;     // Push arg
                 base = argbuff + i + 1;  // Set next arg base
                 // Exit quote mode
@@ -204,15 +1597,59 @@ int process(const char *input, int *status){
         } else if(quote == 0 && argbuff[i] == ' '){
             // Hit space
             argbuff[i] = 0;          // Insert terminator
-            if(base != argbuff + i)
+            if(base != argbuff + i){
+                argop[argn] = 0;
                 args[argn++] = base; // Push arg
+            }
+            base = argbuff + i + 1;  // Set next arg base
+        } else if(quote == 0 && (argbuff[i] == '|' || argbuff[i] == '<' || argbuff[i] == '>' || argbuff[i] == '&')){
+            // Hit pipe, redirection or background
+            char op = argbuff[i];
+            argbuff[i] = 0;          // Insert terminator
+            if(base != argbuff + i){
+                argop[argn] = 0;
+                args[argn++] = base; // Push arg
+            }
+            if(op == '>' && argbuff[i + 1] == '>'){
+                // Append redirection
+                op = 'a';
+                ++i;
+            }
+            argop[argn] = op;
+            args[argn++] = op == '|' ? "|" : op == '<' ? "<" : op == '>' ? ">" : op == '&' ? "&" : ">>";
+            ++nops;
             base = argbuff + i + 1;  // Set next arg base
         }
     }
-    if(base != argbuff + len)
+    if(base < argbuff + len){
+        argop[argn] = 0;
         args[argn++] = base;    // Push last arg
+    }
 
     args[argn] = 0; // terminate arg list
+
+    if(argn == 0)
+        return 0;
+
+    if(nops > 0){
+        // Trailing & runs the command in the background
+        int background = 0;
+        if(argop[argn - 1] == '&'){
+            background = 1;
+            args[--argn] = 0;
+        }
+        if(argn == 0){
+            fprintf(stderr, "syntax error near &\n");
+            *status = 4;
+            return -1;
+        }
+
+        // Pipeline, redirection or background job
+        int ret = pipeline(args, argop, argn, background, input, status);
+        add_history(input);
+        return ret;
+    }
+
     const char *cmd = args[0];
 
     // debug
@@ -231,13 +1668,11 @@ int process(const char *input, int *status){
 
     } else if(strcmp(cmd, "echo") == 0){
         // Echo arguments
-        char buffer[CMD_LEN_MAX];
-        buffer[0] = 0;
         for(int i = 1; i < argn; ++i){
-            strcat(buffer, args[i]);
-            strcat(buffer, " ");
+            fputs(args[i], stdout);
+            fputc(' ', stdout);
         }
-        printf("%s\n", buffer);
+        fputc('\n', stdout);
 
     } else if(strcmp(cmd, "cd") == 0){
         if(argn > 1){
@@ -266,16 +1701,166 @@ int process(const char *input, int *status){
     } else if(strcmp(cmd, "nodebug") == 0){
         debug = 0;
 
+    } else if(strcmp(cmd, "launch") == 0){
+        // Select launch method
+        if(argn > 1 && strcmp(args[1], "fork") == 0){
+            launcher = LAUNCH_FORK;
+        } else if(argn > 1 && strcmp(args[1], "spawn") == 0){
+            launcher = LAUNCH_SPAWN;
+        } else {
+            printf("%s\n", launcher == LAUNCH_FORK ? "fork" : "spawn");
+        }
+
+    } else if(strcmp(cmd, "fast") == 0){
+        // Toggle utility builtins
+        if(argn > 1 && strcmp(args[1], "on") == 0){
+            fastpath = 1;
+        } else if(argn > 1 && strcmp(args[1], "off") == 0){
+            fastpath = 0;
+        } else {
+            printf("%s\n", fastpath ? "on" : "off");
+        }
+
+    } else if(strcmp(cmd, "bench") == 0){
+        // Benchmark launching a program
+        int n = argn > 1 ? atoi(args[1]) : 0;
+        if(n <= 0 || argn < 3){
+            printf("usage: bench <count> <command> [args...]\n");
+        } else if(strlen(args[2]) >= PATH_LEN_MAX){
+            fprintf(stderr, "path is too long\n");
+        } else {
+            char path[PATH_LEN_MAX];
+            strcpy(path, args[2]);
+            int found = search(path) == 0;
+            if(!found && !is_utility(args[2])){
+                printf("Unknown Command\n");
+            } else {
+                bench_launch(n, found ? path : NULL, args + 2, argn - 2);
+            }
+        }
+
+    } else if(strcmp(cmd, "statslog") == 0){
+        // Log stats of every command to a file
+        if(statslog != NULL){
+            fclose(statslog);
+            statslog = NULL;
+        }
+        if(argn > 1 && strcmp(args[1], "off") != 0){
+            statsjson = argn > 2 && strcmp(args[2], "json") == 0;
+            statslog = fopen(args[1], "a");
+            if(statslog == NULL){
+                fprintf(stderr, "%s: %s\n", args[1], strerror(errno));
+            } else if(!statsjson && ftell(statslog) == 0){
+                fprintf(statslog, "time,command,status,wall,utime,stime,maxrss,minflt,majflt,inblock,oublock,nvcsw,nivcsw\n");
+            }
+        }
+
+    } else if(strcmp(cmd, "jobs") == 0){
+        // List background jobs
+        sigset_t old;
+        block_sigchld(&old);
+        for(int j = 0; j < njobs; ++j){
+            printf("[%d] %s\t%s\n", joblist[j].id, joblist[j].nleft ? "Running" : "Done", joblist[j].cmd);
+        }
+        sigprocmask(SIG_SETMASK, &old, NULL);
+
+    } else if(strcmp(cmd, "fanout") == 0){
+        // Run a command for each input in parallel
+        int nproc = sysconf(_SC_NPROCESSORS_ONLN);
+        int first = 1;
+        if(argn > 2 && strcmp(args[1], "-j") == 0){
+            nproc = atoi(args[2]);
+            first = 3;
+        }
+        int sep = first;
+        while(sep < argn && strcmp(args[sep], ":::") != 0)
+            ++sep;
+
+        if(nproc <= 0 || sep == first || sep == argn){
+            printf("usage: fanout [-j n] command [args...] ::: inputs...\n");
+        } else if(strlen(args[first]) >= PATH_LEN_MAX){
+            fprintf(stderr, "path is too long\n");
+            *status = 4;
+        } else {
+            char path[PATH_LEN_MAX];
+            strcpy(path, args[first]);
+            if(search(path) != 0){
+                *status = 2;
+            } else {
+                *status = 3;
+                args[sep] = NULL;
+                ret = fanout(path, args + first, sep - first, args + sep + 1, argn - sep - 1, nproc);
+            }
+        }
+
+    } else if(strcmp(cmd, "wait") == 0){
+        // Wait for background jobs
+        if(argn > 1){
+            for(int i = 1; i < argn; ++i)
+                wait_jobs(atoi(args[i][0] == '%' ? args[i] + 1 : args[i]));
+        } else {
+            wait_jobs(0);
+        }
+
+    } else if(strcmp(cmd, "hash") == 0){
+        if(argn > 1 && strcmp(args[1], "-r") == 0){
+            // Forget all hashed commands
+            hash_clear();
+        } else if(argn > 1){
+            // Look up and hash commands
+            for(int i = 1; i < argn; ++i){
+                char path[PATH_LEN_MAX];
+                strncpy(path, args[i], PATH_LEN_MAX - 1);
+                path[PATH_LEN_MAX - 1] = 0;
+                if(strchr(path, '/') != NULL)
+                    continue;
+                if(search(path) != 0){
+                    printf("hash: %s: not found\n", args[i]);
+                } else {
+                    // Lookup from the hash builtin is not a hit
+                    struct hash_entry *ent = hash_find(args[i]);
+                    if(ent != NULL)
+                        ent->hits--;
+                }
+            }
+        } else {
+            // Print hashed commands
+            printf("hits\tcommand\n");
+            for(int i = 0; i < HASH_BUCKETS; ++i){
+                for(struct hash_entry *ent = cmdhash[i]; ent != NULL; ent = ent->next){
+                    printf("%4d\t%s\n", ent->hits, ent->path);
+                }
+            }
+        }
+
     } else if(strcmp(cmd, "history") == 0){
         savehist = 0;
-        for(int i = 0; i < histlen; ++i){
-            printf("%d\t%s\n", i, history[i]);
+        int count = hist_count();
+        int first = 0;
+        if(argn > 1){
+            // Only the last n entries
+            first = count - atoi(args[1]);
+            if(first < 0)
+                first = 0;
+        }
+        for(int i = first; i < count; ++i){
+            size_t len;
+            const char *prev = hist_get(i, &len);
+            printf("%d\t%.*s\n", i, (int)len, prev);
+        }
+
+    } else if(strcmp(cmd, "search") == 0){
+        savehist = 0;
+        if(argn > 1){
+            search_history(args[1]);
+        } else {
+            printf("search: missing text\n");
         }
 
     } else if(strcmp(cmd, "!!") == 0){
         savehist = 0;
-        if(histlen > 0){
-            const char *prev = history[histlen - 1];
+        if(hist_count() > 0){
+            const char *prev = hist_str(hist_count() - 1);
             printf("%s\n", prev);
             return process(prev, status);
         } else {
@@ -285,8 +1870,8 @@ int process(const char *input, int *status){
     } else if(cmd[0] == '!'){
         savehist = 0;
         int num = atoi(cmd+1);
-        if(histlen > num){
-            const char *prev = history[num];
+        if(num >= 0 && hist_count() > num){
+            const char *prev = hist_str(num);
             printf("%s\n", prev);
             return process(prev, status);
         } else {
@@ -295,19 +1880,43 @@ int process(const char *input, int *status){
 
     } else if(strcmp(cmd, "help") == 0){
         printf("exit - exit the shell\n");
+        printf("(choong-sh file runs a script, prompts only show on a terminal)\n");
         printf("echo - echo arguments\n");
         printf("cd - change working directory\n");
         printf("pwd - print working directory\n");
-        printf("history - print history\n");
+        printf("history [n] - print history, or its last n entries\n");
+        printf("(history is kept in $%s, or ~/%s on a terminal)\n", HISTFILE, HISTFILE_NAME);
+        printf("search text - list history entries containing text\n");
+        printf("hash [-r] [name...] - print, clear or add hashed command paths\n");
+        printf("launch [fork|spawn] - print or set how programs are started\n");
+        printf("bench n cmd [args...] - launch cmd n times with each method, and as a builtin\n");
+        printf("fast [on|off] - print or set running test, [, true, false, printf, cat and mkdir as builtins\n");
+        printf("cmd < in | cmd > out - pipelines and redirection (>> appends)\n");
+        printf("cmd & - run cmd in the background\n");
+        printf("jobs - list background jobs\n");
+        printf("statslog file [csv|json] | off - log stats of every command\n");
+        printf("wait [n...] - wait for background jobs\n");
+        printf("fanout [-j n] cmd [args...] ::: inputs... - run cmd for each input, n at a time\n");
+        printf("(each argument {} is replaced by the input, stdout is grouped by job)\n");
         printf("!! - run last command in history\n");
         printf("!n - run nth command in history\n");
 
+    } else if(fastpath && is_utility(cmd)){
+        // Same status as an external program, without starting one
+        *status = 3;
+        ret = utility(args, argn);
+
     } else {
         // External program
         char path[PATH_LEN_MAX];
-        strcpy(path, cmd);
-        // Search for program
-        int stat = search(path);
+        int stat = -1;
+        if(strlen(cmd) >= PATH_LEN_MAX)
+            fprintf(stderr, "path is too long\n");
+        else {
+            strcpy(path, cmd);
+            // Search for program
+            stat = search(path);
+        }
         if(stat < 0){
             // error
             *status = 4;
@@ -329,6 +1938,75 @@ int process(const char *input, int *status){
     return ret;
 }
 
+// Block buffered line reader, lines may be any length
+struct reader {
+    int fd;
+    char *buf;
+    size_t size;    // buffer capacity
+    size_t start;   // start of the next line
+    size_t scan;    // data before this has no newline
+    size_t end;     // end of data read
+    int eof;
+};
+
+void reader_init(struct reader *rd, int fd){
+    rd->fd = fd;
+    rd->size = READ_BLOCK;
+    rd->buf = malloc(rd->size + 1);
+    rd->start = rd->scan = rd->end = 0;
+    rd->eof = 0;
+}
+
+/* Returns the next line with its newline replaced by a terminator, or NULL at end of input.
+ * Each byte is scanned for a newline once, however many reads a line spans.
+ */
+char *read_line(struct reader *rd){
+    while(1){
+        char *nl = memchr(rd->buf + rd->scan, '\n', rd->end - rd->scan);
+        if(nl != NULL){
+            char *line = rd->buf + rd->start;
+            *nl = 0;
+            rd->start = rd->scan = nl - rd->buf + 1;
+            return line;
+        }
+        rd->scan = rd->end;
+
+        if(rd->eof){
+            if(rd->start == rd->end)
+                return NULL;
+            // Last line without a newline
+            char *line = rd->buf + rd->start;
+            rd->buf[rd->end] = 0;
+            rd->start = rd->scan = rd->end;
+            return line;
+        }
+
+        // Move the partial line to the front, grow the buffer if it is full
+        if(rd->start > 0){
+            memmove(rd->buf, rd->buf + rd->start, rd->end - rd->start);
+            rd->end -= rd->start;
+            rd->scan -= rd->start;
+            rd->start = 0;
+        }
+        if(rd->end == rd->size){
+            rd->size *= 2;
+            rd->buf = realloc(rd->buf, rd->size + 1);
+        }
+
+        ssize_t n = read(rd->fd, rd->buf + rd->end, rd->size - rd->end);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "read error %d %s\n", errno, strerror(errno));
+            rd->eof = 1;
+        } else if(n == 0){
+            rd->eof = 1;
+        } else {
+            rd->end += n;
+        }
+    }
+}
+
 void sig_handler(int sig){
 //    printf("sigint caught\n");
 //    fprintf(stdin, "\n");
@@ -336,35 +2014,58 @@ void sig_handler(int sig){
 
 int main(int argc, const char **argv){
     int status = 0;
-    char cmd[CMD_LEN_MAX];
+    struct reader rd;
+
+    // Run a script file, or read commands from stdin
+    int fd = STDIN_FILENO;
+    if(argc > 1){
+        fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if(fd == -1){
+            fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+    // No prompts in scripts or when input is piped in
+    interactive = isatty(fd);
+    reader_init(&rd, fd);
+
+    // Persistent history
+    const char *histpath = getenv(HISTFILE);
+    char histdefault[PATH_LEN_MAX];
+    if(histpath == NULL && interactive && getenv(HOME) != NULL){
+        snprintf(histdefault, PATH_LEN_MAX, "%s/%s", getenv(HOME), HISTFILE_NAME);
+        histpath = histdefault;
+    }
+    if(histpath != NULL)
+        hist_open(histpath);
 
 //    signal(SIGINT, sig_handler);
 
+    // Reap background jobs as they finish
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
     while(1){
-        // First check stdin
-        if(feof(stdin)){
-            // End of file
-            printf("exit\n");
-            break;
-        }
+        // Report finished background jobs
+        notify_jobs();
 
         // Write prompt
-        printf(PROMPT " ");
-
-        // Read line
-        if(fgets(cmd, CMD_LEN_MAX, stdin) == NULL){
-            if(feof(stdin))
-                continue;
-            fprintf(stderr, "fgets error\n");
-            continue;
+        if(interactive){
+            printf(PROMPT " ");
+            fflush(stdout);
         }
 
-        // first newline becomes a terminator
-        for(int i = 0; i < strlen(cmd); ++i){
-            if(cmd[i] == '\n'){
-                cmd[i] = 0;
-                break;
-            }
+        // Read line, the newline is already a terminator
+        char *cmd = read_line(&rd);
+        if(cmd == NULL){
+            // End of file
+            if(interactive)
+                printf("exit\n");
+            break;
         }
 
         // Process input
@@ -387,10 +2088,31 @@ int main(int argc, const char **argv){
         }
     }
 
-    for(int i = 0; i < histlen; ++i){
-        free(history[i]);
+    while(histchunks != NULL){
+        struct hist_chunk *next = histchunks->next;
+        free(histchunks);
+        histchunks = next;
     }
     free(history);
+    hist_close();
+    free(histrun);
+    free(lastquery);
+    free(searchhits);
+
+    free(argbuff);
+    free(args);
+    free(argop);
+    free(stagebuf);
+
+    hash_clear();
+    free(hashpath);
+
+    if(statslog != NULL)
+        fclose(statslog);
+
+    free(rd.buf);
+    if(fd != STDIN_FILENO)
+        close(fd);
 
     return 0;
 }
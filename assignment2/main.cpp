@@ -10,28 +10,102 @@
 #include "zwrapallocator.h"
 using namespace LibChaos;
 
+#include "slaballocator.h"
+
 #include <unistd.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <cmath>
+#include <atomic>
 #include <iostream>
+#include <fstream>
+
+enum Arrival {
+    ARRIVAL_CLOSED = 0,     //!< Sleep a uniform random time before each job, then measure.
+    ARRIVAL_UNIFORM,        //!< Open loop, uniform interarrival times.
+    ARRIVAL_EXPONENTIAL,    //!< Open loop, exponential interarrival times (Poisson arrivals).
+    ARRIVAL_TRACE,          //!< Open loop, interarrival times replayed from a trace file.
+};
+
+enum Kernel {
+    KERNEL_SLEEP = 0,       //!< Sleep for the service time.
+    KERNEL_SPIN,            //!< Busy-spin on the CPU for the service time.
+    KERNEL_STREAM,          //!< Stream through a large private buffer for the service time.
+    KERNEL_HASH,            //!< Repeatedly hash the job payload for the service time.
+};
+
+#define JOB_PAYLOAD 64
+// Larger than the last level cache, so streaming exercises memory bandwidth
+#define STREAM_SIZE (64 << 20)
 
 struct Job {
     int id;
-    bool exit;
+    //! Time the job was scheduled to be sent, in monotonic seconds.
+    double sched;
     double qtime;
-    ZClock clock;
+    zbyte payload[JOB_PAYLOAD];
+    //! Result of the service kernel, keeps the work from being optimized out.
+    zu64 digest;
+};
+
+/* A span of consecutive jobs in the shared job table. Producers claim and enqueue a span of
+ * up to batch jobs at once, consumers dequeue and run a whole span, so the queue lock and
+ * condition signal are paid once per span instead of once per job.
+ */
+struct JobSpan {
+    zu64 first;
+    zu32 count;
+    bool exit;
+};
+
+/* Latency histogram buckets. Each power of two of microseconds is split in 8 linear
+ * sub-buckets, so a bucket is within 12.5% of the latencies it counts.
+ */
+#define LAT_BUCKETS 320
+
+/* Per-worker live counters. Each slot has a single writer, its worker, which updates it with
+ * relaxed loads and stores instead of locked read-modify-writes. The parent samples them
+ * without any locking.
+ */
+struct WorkerStats {
+    std::atomic<zu64> sent;
+    std::atomic<zu64> dequeued;
+    std::atomic<zu64> done;
+    std::atomic<zu64> hist[LAT_BUCKETS];
 };
 
 struct Share {
     zu32 arate;
     zu32 srate;
+    zu32 batch;
+    Kernel kernel;
+
+    // open loop arrival schedule
+    Arrival arrival;
+    double aperiod;
+    double start;
 
-    ZWorkQueue<Job> *queue;
+    // live stats, producers then consumers
+    WorkerStats *stats;
+
+    // shared job table, indexed by job id
+    Job *jobs;
+    ZWorkQueue<JobSpan> *queue;
 
     // producer mutex and fields
     ZMutex *prlock;
     zu64 total;
+    zu64 producers;         // producers still running
+    zu64 seq;
+    double next;
+    double lag;
 
     // consumer mutex and fields
     ZMutex *cslock;
@@ -39,9 +113,147 @@ struct Share {
     zu64 qweight;
     double ttime;
     zu64 tweight;
+    zu64 spans;
+    double tmax;
 };
 
-void runProducer(int num, Share *share){
+// Interarrival times in seconds for trace replay, loaded before fork()
+static ZArray<double> trace;
+
+double monoSecs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// Increment a counter that only the calling process writes
+inline void bump(std::atomic<zu64> &counter, zu64 n = 1){
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+unsigned latBucket(double sec){
+    zu64 us = (zu64)(sec * 1000000);
+    if(us < 8)
+        return (unsigned)us;
+    unsigned log = 63 - __builtin_clzll(us);
+    unsigned b = (log - 2) * 8 + ((us >> (log - 3)) & 7);
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+// Upper bound of a latency bucket in seconds
+double latBucketMax(unsigned b){
+    if(b < 8)
+        return (b + 1) / 1000000.0;
+    unsigned log = b / 8 + 2;
+    return (double)((zu64)(8 + b % 8 + 1) << (log - 3)) / 1000000.0;
+}
+
+// Next open loop interarrival time in seconds. Called with the producer lock held.
+double interArrival(Share *share, ZRandom &random){
+    switch(share->arrival){
+        case ARRIVAL_EXPONENTIAL: {
+            double u = (double)random.genzu(1, 0xFFFFFFFF) / 0xFFFFFFFF;
+            return -std::log(u) * share->aperiod;
+        }
+        case ARRIVAL_TRACE:
+            return trace[share->seq++ % trace.size()];
+        case ARRIVAL_UNIFORM:
+        default:
+            return random.genzu(0, 2000000 * share->aperiod) / 1000000.0;
+    }
+}
+
+/* Run the service kernel for rtime microseconds. The CPU kernels check the clock between
+ * small units of work, so their duration is calibrated against real time rather than a
+ * fixed iteration count.
+ */
+zu64 serve(Share *share, Job &j, zu32 rtime, zbyte *stream, zu64 &spos){
+    if(share->kernel == KERNEL_SLEEP){
+        ZThread::usleep(rtime);
+        return 0;
+    }
+
+    double end = monoSecs() + rtime / 1000000.0;
+    zu64 acc = 0;
+    switch(share->kernel){
+        case KERNEL_SPIN:
+            do {
+                ++acc;
+            } while(monoSecs() < end);
+            break;
+
+        case KERNEL_STREAM:
+            do {
+                // read-modify-write one page
+                zu64 *p = (zu64 *)(stream + spos);
+                for(zu64 k = 0; k < 4096 / sizeof(zu64); ++k){
+                    acc += p[k];
+                    p[k] = acc;
+                }
+                spos = (spos + 4096) % STREAM_SIZE;
+            } while(monoSecs() < end);
+            break;
+
+        case KERNEL_HASH:
+            // FNV-1a
+            acc = 14695981039346656037ULL;
+            do {
+                for(int r = 0; r < 16; ++r){
+                    for(int k = 0; k < JOB_PAYLOAD; ++k){
+                        acc ^= j.payload[k];
+                        acc *= 1099511628211ULL;
+                    }
+                }
+            } while(monoSecs() < end);
+            break;
+
+        default:
+            break;
+    }
+    return acc;
+}
+
+// Parse a CPU list like "0-3,6"
+bool parseCpus(const char *str, ZArray<int> &cpus){
+    while(*str){
+        char *end;
+        long lo = strtol(str, &end, 10);
+        if(end == str || lo < 0)
+            return false;
+        long hi = lo;
+        if(*end == '-'){
+            str = end + 1;
+            hi = strtol(str, &end, 10);
+            if(end == str || hi < lo)
+                return false;
+        }
+        for(long c = lo; c <= hi; ++c)
+            cpus.push((int)c);
+        if(*end == ',')
+            ++end;
+        else if(*end)
+            return false;
+        str = end;
+    }
+    return !cpus.isEmpty();
+}
+
+// Pin the calling process to one CPU from the list, round robin by worker number
+void pinCpu(const ZArray<int> &cpus, int num){
+    if(cpus.isEmpty())
+        return;
+    int cpu = cpus[num % cpus.size()];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set) != 0){
+        ELOG("Failed to pin to CPU " << cpu << ": " << strerror(errno));
+    } else {
+        DLOG("Pinned to CPU " << cpu);
+    }
+}
+
+void runProducer(int num, Share *share, WorkerStats *stats){
     zu32 atime = share->arate;
     LOG("Producer " <<  num << " start");
 
@@ -49,82 +261,267 @@ void runProducer(int num, Share *share){
     ZClock clock;
 
     zu64 count = 0;
+    double lag = 0;
     bool run = true;
     while(run){
         share->prlock->lock();
 
-        // check remaining jobs
-        if(share->total)
-            share->total--;
-        else
+        // claim a span of remaining jobs
+        zu64 n = share->total < share->batch ? share->total : share->batch;
+        share->total -= n;
+        if(!n)
             run = false;
 
-        int id = share->total;
+        zu64 first = share->total;
+
+        if(share->arrival != ARRIVAL_CLOSED){
+            /* Extend the absolute arrival schedule over the claimed jobs. The schedule is
+             * shared by all producers, so a producer that falls behind does not lower the
+             * offered load.
+             */
+            for(zu64 i = n; i > 0; --i){
+                share->next += interArrival(share, random);
+                share->jobs[first + i - 1].sched = share->next;
+            }
+        }
 
         share->prlock->unlock();
 
         if(run){
-            ZClock qclock;
-            zu32 rtime = random.genzu(0, 2 * atime);
-            DLOG("Queue " << id << ": " << rtime);
-            // delay random time before adding each job
-            ZThread::usleep(rtime);
-            share->queue->addWork({ id, false, qclock.getSecs(), qclock });
-            ++count;
-
-            if(!id){
-                // After the last job, add the exit job
-                DLOG("Queue Exit");
-                share->queue->addWork({ 0, true, 0, ZClock() });
+            // jobs are generated in descending id order, like the unbatched producer
+            for(zu64 i = n; i > 0; --i){
+                int id = (int)(first + i - 1);
+                Job &j = share->jobs[id];
+                j.id = id;
+                if(share->kernel == KERNEL_HASH){
+                    for(int k = 0; k < JOB_PAYLOAD; ++k)
+                        j.payload[k] = (zbyte)random.genzu(0, 255);
+                }
+                if(share->arrival == ARRIVAL_CLOSED){
+                    j.sched = monoSecs();
+                    zu32 rtime = random.genzu(0, 2 * atime);
+                    DLOG("Queue " << id << ": " << rtime);
+                    // delay random time before adding each job
+                    ZThread::usleep(rtime);
+                } else {
+                    // wait for the intended send time, never for the queue
+                    double wait = j.sched - monoSecs();
+                    DLOG("Queue " << id << ": " << wait);
+                    if(wait > 0)
+                        ZThread::usleep((zu64)(wait * 1000000));
+                    else
+                        lag -= wait;
+                }
+            }
+
+            // queue time includes the time a job waited for the rest of its span
+            double now = monoSecs();
+            for(zu64 i = 0; i < n; ++i){
+                Job &j = share->jobs[first + i];
+                j.qtime = now - j.sched;
             }
+            share->queue->addWork({ first, (zu32)n, false });
+            count += n;
+            bump(stats->sent, n);
         }
     }
+
+    share->prlock->lock();
+    share->lag += lag;
+    bool last = --share->producers == 0;
+    share->prlock->unlock();
+
+    if(last){
+        /* Other producers may still have been sleeping through spans they claimed, so the
+         * exit job waits for the last producer to finish.
+         */
+        DLOG("Queue Exit");
+        share->queue->addWork({ 0, 0, true });
+    }
+
     LOG("Producer " << num << " done: " << count << " jobs, " << clock.getSecs() << " seconds");
 }
 
-void runConsumer(int num, Share *share){
+void runConsumer(int num, Share *share, WorkerStats *stats){
     zu32 stime = share->srate;
     LOG("Consumer " << num << " start");
 
     ZRandom random;
     ZClock clock;
 
+    // private buffer for the streaming kernel, touched up front to fault it in
+    zbyte *stream = nullptr;
+    zu64 spos = 0;
+    if(share->kernel == KERNEL_STREAM){
+        stream = new zbyte[STREAM_SIZE];
+        memset(stream, 0, STREAM_SIZE);
+    }
+
     zu64 count = 0;
     bool run = true;
     while(run){
-        Job j = share->queue->getWork();
+        JobSpan span = share->queue->getWork();
 
-        if(j.exit){
+        if(span.exit){
             DLOG("Exit Job");
             // Duplicate the exit job for other consumers
-            share->queue->addWork(j);
+            share->queue->addWork(span);
             run = false;
         } else {
-            zu32 rtime = random.genzu(0, 2 * stime);
-            // do the job's "work"
-            ZThread::usleep(rtime);
-            double sec = j.clock.getSecs();
-            ++count;
-            j.clock.stop();
-            DLOG("Job " << j.id << ": " << rtime << ", " << j.clock.str());
+            bump(stats->dequeued, span.count);
+
+            double qtime = 0;
+            double ttime = 0;
+            double tmax = 0;
+            for(zu64 i = 0; i < span.count; ++i){
+                Job &j = share->jobs[span.first + i];
+                zu32 rtime = random.genzu(0, 2 * stime);
+                // do the job's "work"
+                j.digest = serve(share, j, rtime, stream, spos);
+                double sec = monoSecs() - j.sched;
+                ++count;
+                DLOG("Job " << j.id << ": " << rtime << ", " << sec);
+                bump(stats->hist[latBucket(sec)]);
+                bump(stats->done);
+
+                qtime += j.qtime;
+                ttime += sec;
+                if(sec > tmax)
+                    tmax = sec;
+            }
 
             share->cslock->lock();
 
-            // update timing data
-            share->qtime += j.qtime;
-            share->qweight += 1;
-            share->ttime += sec;
-            share->tweight += 1;
+            // update timing data once per span
+            share->qtime += qtime;
+            share->qweight += span.count;
+            share->ttime += ttime;
+            share->tweight += span.count;
+            share->spans += 1;
+            if(tmax > share->tmax)
+                share->tmax = tmax;
 
             share->cslock->unlock();
         }
     }
+    delete[] stream;
     LOG("Consumer " << num << " done: " << count << " jobs, " << clock.getSecs() << " seconds");
 }
 
-#define OPT_DBG "debug"
+// Live metrics sampled by the parent while the workers run
+struct Metrics {
+    int fd;
+    bool json;
+    double interval;
+    double last;
+    zu64 done;
+    zu64 hist[LAT_BUCKETS];
+};
+
+// Open a metrics file, or a Unix stream socket for paths like unix:/run/metrics.sock
+int openMetrics(const char *path){
+    if(strncmp(path, "unix:", 5) == 0){
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path + 5, sizeof(addr.sun_path) - 1);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd < 0)
+            return -1;
+        if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+            close(fd);
+            return -1;
+        }
+        // a reader going away should end the stream, not the run
+        signal(SIGPIPE, SIG_IGN);
+        return fd;
+    }
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+double percentile(const zu64 *hist, zu64 total, double p){
+    zu64 rank = (zu64)std::ceil(total * p);
+    zu64 sum = 0;
+    for(unsigned b = 0; b < LAT_BUCKETS; ++b){
+        sum += hist[b];
+        if(sum >= rank && sum)
+            return latBucketMax(b);
+    }
+    return 0;
+}
+
+// Write one line of per-interval throughput, queue depth and latency percentiles
+void sampleMetrics(Metrics *m, Share *share, unsigned nworkers){
+    double now = monoSecs();
+    zu64 sent = 0;
+    zu64 dequeued = 0;
+    zu64 done = 0;
+    zu64 hist[LAT_BUCKETS];
+    memset(hist, 0, sizeof(hist));
+    for(unsigned i = 0; i < nworkers; ++i){
+        WorkerStats &st = share->stats[i];
+        sent += st.sent.load(std::memory_order_relaxed);
+        dequeued += st.dequeued.load(std::memory_order_relaxed);
+        done += st.done.load(std::memory_order_relaxed);
+        for(unsigned b = 0; b < LAT_BUCKETS; ++b)
+            hist[b] += st.hist[b].load(std::memory_order_relaxed);
+    }
+
+    // latencies of jobs finished in this interval
+    zu64 ndone = done - m->done;
+    zu64 dhist[LAT_BUCKETS];
+    for(unsigned b = 0; b < LAT_BUCKETS; ++b)
+        dhist[b] = hist[b] - m->hist[b];
+    zu64 depth = sent > dequeued ? sent - dequeued : 0;
+    double rate = ndone / (now - m->last);
+
+    char line[512];
+    int len;
+    if(m->json){
+        len = snprintf(line, sizeof(line),
+                       "{\"time\":%.3f,\"done\":%lu,\"throughput\":%.3f,\"depth\":%lu,\"p50\":%.6f,\"p90\":%.6f,\"p99\":%.6f,\"p999\":%.6f}\n",
+                       now - share->start, (unsigned long)done, rate, (unsigned long)depth,
+                       percentile(dhist, ndone, 0.5), percentile(dhist, ndone, 0.9),
+                       percentile(dhist, ndone, 0.99), percentile(dhist, ndone, 0.999));
+    } else {
+        len = snprintf(line, sizeof(line), "%.3f,%lu,%.3f,%lu,%.6f,%.6f,%.6f,%.6f\n",
+                       now - share->start, (unsigned long)done, rate, (unsigned long)depth,
+                       percentile(dhist, ndone, 0.5), percentile(dhist, ndone, 0.9),
+                       percentile(dhist, ndone, 0.99), percentile(dhist, ndone, 0.999));
+    }
+    if(write(m->fd, line, len) != len){
+        ELOG("metrics write failed, stopping metrics: " << strerror(errno));
+        close(m->fd);
+        m->fd = -1;
+    }
+
+    m->last = now;
+    m->done = done;
+    memcpy(m->hist, hist, sizeof(hist));
+}
+
+#define OPT_DBG     "debug"
+#define OPT_BATCH   "batch"
+#define OPT_ARRIVAL "arrival"
+#define OPT_TRACE   "trace"
+#define OPT_KERNEL  "kernel"
+#define OPT_PINPROD "pin-producers"
+#define OPT_PINCONS "pin-consumers"
+#define OPT_METRICS "metrics"
+#define OPT_MINTERV "metrics-interval"
+#define OPT_MFORMAT "metrics-format"
 const ZArray<ZOptions::OptDef> optdef = {
-    { OPT_DBG,  'd', ZOptions::NONE },
+    { OPT_DBG,      'd', ZOptions::NONE },
+    { OPT_BATCH,    'b', ZOptions::INTEGER },
+    { OPT_ARRIVAL,  'a', ZOptions::STRING },
+    { OPT_TRACE,    't', ZOptions::STRING },
+    { OPT_KERNEL,   'k', ZOptions::STRING },
+    { OPT_PINPROD,  'P', ZOptions::STRING },
+    { OPT_PINCONS,  'C', ZOptions::STRING },
+    { OPT_METRICS,  'm', ZOptions::STRING },
+    { OPT_MINTERV,  'i', ZOptions::STRING },
+    { OPT_MFORMAT,  'f', ZOptions::STRING },
 };
 
 int main(int argc, char **argv){
@@ -133,7 +530,7 @@ int main(int argc, char **argv){
 
     ZOptions options(optdef);
     if(!options.parse(argc, argv) || options.getArgs().size() != 5){
-        LOG("Usage: assignemnt2 [-d|--debug] <num_producers> <num_consumers> <requests> <arrival_rate> <service_rate>");
+        LOG("Usage: assignemnt2 [-d|--debug] [-b|--batch N] [-a|--arrival closed|uniform|exponential|trace] [-t|--trace FILE] [-k|--kernel sleep|spin|stream|hash] [-P|--pin-producers CPUS] [-C|--pin-consumers CPUS] [-m|--metrics FILE|unix:SOCKET] [-i|--metrics-interval SECS] [-f|--metrics-format csv|json] <num_producers> <num_consumers> <requests> <arrival_rate> <service_rate>");
         return EXIT_FAILURE;
     }
 
@@ -149,8 +546,116 @@ int main(int argc, char **argv){
         ZLog::logLevelStdOut(ZLog::DEBUG, "[%clock%] %pid% D %log%");
     }
 
+    zu32 batch = 1;
+    if(options.getOpts().contains(OPT_BATCH)){
+        batch = (zu32)options.getOpts()[OPT_BATCH].toUint();
+        if(!batch){
+            ELOG("batch size must be at least 1");
+            return EXIT_FAILURE;
+        }
+    }
+
+    Arrival arrival = ARRIVAL_CLOSED;
+    if(options.getOpts().contains(OPT_TRACE))
+        arrival = ARRIVAL_TRACE;
+    if(options.getOpts().contains(OPT_ARRIVAL)){
+        ZString mode = options.getOpts()[OPT_ARRIVAL];
+        if(mode == "closed"){
+            arrival = ARRIVAL_CLOSED;
+        } else if(mode == "uniform"){
+            arrival = ARRIVAL_UNIFORM;
+        } else if(mode == "exponential"){
+            arrival = ARRIVAL_EXPONENTIAL;
+        } else if(mode == "trace"){
+            arrival = ARRIVAL_TRACE;
+        } else {
+            ELOG("unknown arrival mode " << mode);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(arrival == ARRIVAL_TRACE){
+        if(!options.getOpts().contains(OPT_TRACE)){
+            ELOG("trace arrivals need a trace file");
+            return EXIT_FAILURE;
+        }
+        // one interarrival time in seconds per line
+        std::ifstream tfile(options.getOpts()[OPT_TRACE].cc());
+        double t;
+        while(tfile >> t)
+            trace.push(t);
+        if(trace.isEmpty()){
+            ELOG("empty or unreadable trace file " << options.getOpts()[OPT_TRACE]);
+            return EXIT_FAILURE;
+        }
+        LOG("Trace: " << trace.size() << " interarrival times");
+    }
+
+    Kernel kernel = KERNEL_SLEEP;
+    if(options.getOpts().contains(OPT_KERNEL)){
+        ZString name = options.getOpts()[OPT_KERNEL];
+        if(name == "sleep"){
+            kernel = KERNEL_SLEEP;
+        } else if(name == "spin"){
+            kernel = KERNEL_SPIN;
+        } else if(name == "stream"){
+            kernel = KERNEL_STREAM;
+        } else if(name == "hash"){
+            kernel = KERNEL_HASH;
+        } else {
+            ELOG("unknown service kernel " << name);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // CPU lists are copied into each child by fork()
+    ZArray<int> pcpus;
+    if(options.getOpts().contains(OPT_PINPROD) && !parseCpus(options.getOpts()[OPT_PINPROD].cc(), pcpus)){
+        ELOG("bad producer CPU list " << options.getOpts()[OPT_PINPROD]);
+        return EXIT_FAILURE;
+    }
+    ZArray<int> ccpus;
+    if(options.getOpts().contains(OPT_PINCONS) && !parseCpus(options.getOpts()[OPT_PINCONS].cc(), ccpus)){
+        ELOG("bad consumer CPU list " << options.getOpts()[OPT_PINCONS]);
+        return EXIT_FAILURE;
+    }
+
+    Metrics metrics;
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.fd = -1;
+    metrics.interval = 1;
+    if(options.getOpts().contains(OPT_MINTERV)){
+        metrics.interval = options.getOpts()[OPT_MINTERV].toFloat();
+        if(metrics.interval <= 0){
+            ELOG("metrics interval must be positive");
+            return EXIT_FAILURE;
+        }
+    }
+    if(options.getOpts().contains(OPT_MFORMAT)){
+        ZString format = options.getOpts()[OPT_MFORMAT];
+        if(format == "json"){
+            metrics.json = true;
+        } else if(!(format == "csv")){
+            ELOG("unknown metrics format " << format);
+            return EXIT_FAILURE;
+        }
+    }
+    if(options.getOpts().contains(OPT_METRICS)){
+        metrics.fd = openMetrics(options.getOpts()[OPT_METRICS].cc());
+        if(metrics.fd < 0){
+            ELOG("cannot open metrics " << options.getOpts()[OPT_METRICS] << ": " << strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if(!metrics.json){
+            const char *header = "time,done,throughput,depth,p50,p90,p99,p999\n";
+            if(write(metrics.fd, header, strlen(header)) < 0)
+                ELOG("metrics write failed: " << strerror(errno));
+        }
+    }
+
     LOG("Producers: " << nproducer << ", Consumers: " << nconsumer);
-    LOG("Requests: " << requests);
+    LOG("Requests: " << requests << ", Batch: " << batch);
+    LOG("Service Kernel: " << (kernel == KERNEL_SPIN ? "spin" : kernel == KERNEL_STREAM ? "stream" : kernel == KERNEL_HASH ? "hash" : "sleep"));
     LOG("Arrival Rate: " << arate << " requests/second, Service Rate: " << srate << " requests/second");
 
     /* Allocate shared memory. This is cheap, and could be much larger than the needed size.
@@ -161,8 +666,9 @@ int main(int argc, char **argv){
     const zu64 psize = (
                 sizeof(Share) + 16 +
                 sizeof(ZMutex) + 16 +
-                sizeof(ZWorkQueue<Job>) + 16 +
-                ((sizeof(ZList<Job>::Node) + 16) * requests) +
+                sizeof(ZWorkQueue<JobSpan>) + 16 +
+                (sizeof(Job) * requests) + 16 +
+                (sizeof(WorkerStats) * (nproducer + nconsumer)) + 16 +
                 16
                 ) * 2;
     LOG("Allocate " << psize << " bytes shared memory");
@@ -172,6 +678,19 @@ int main(int argc, char **argv){
         return -1;
     }
 
+    /* Queue nodes get their own region, sized exactly. Every span is enqueued once, and the
+     * exit job is enqueued once by a producer and once more by each consumer. Freed nodes are
+     * recycled, so this is an upper bound that is only reached without any reuse.
+     */
+    const zu64 ncapacity = (requests + batch - 1) / batch + 1 + nconsumer;
+    const zu64 nsize = SlabAllocator<typename ZList<JobSpan>::Node>::regionSize(ncapacity);
+    LOG("Allocate " << nsize << " bytes shared node slab");
+    void *npool = mmap(NULL, nsize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if(npool == MAP_FAILED){
+        ELOG("map failed");
+        return -1;
+    }
+
     /* Pool allocator over shared memory pool. Allocation metadata is stored in the pool, so
      * this allocator structure can be safely copied by a fork() after this point.
      */
@@ -182,26 +701,50 @@ int main(int argc, char **argv){
      */
     ZAllocator<Share> *salloc = new ZWrapAllocator<Share>(alloc);
     ZAllocator<ZMutex> *lalloc = new ZWrapAllocator<ZMutex>(alloc);
-    ZAllocator<ZWorkQueue<Job>> *qalloc = new ZWrapAllocator<ZWorkQueue<Job>>(alloc);
-    // job allocator for queue
-    ZAllocator<typename ZList<Job>::Node> *jalloc = new ZWrapAllocator<typename ZList<Job>::Node>(alloc);
+    ZAllocator<ZWorkQueue<JobSpan>> *qalloc = new ZWrapAllocator<ZWorkQueue<JobSpan>>(alloc);
+    ZAllocator<Job> *talloc = new ZWrapAllocator<Job>(alloc);
+    ZAllocator<WorkerStats> *walloc = new ZWrapAllocator<WorkerStats>(alloc);
+    /* Span allocator for queue. Each process gets its own copy of the allocator object after
+     * fork(), which holds that process' magazine of free nodes.
+     */
+    SlabAllocator<typename ZList<JobSpan>::Node> *jalloc = new SlabAllocator<typename ZList<JobSpan>::Node>(npool, ncapacity);
 
     // Allocate shared data structures on the shared memory pool
     Share *share = salloc->construct(salloc->alloc(), 1);
+    share->jobs = talloc->construct(talloc->alloc(requests), requests);
+    share->stats = walloc->construct(walloc->alloc(nproducer + nconsumer), nproducer + nconsumer);
     share->queue = qalloc->construct(qalloc->alloc(), 1, jalloc, ZCondition::PSHARE);
     share->prlock = lalloc->construct(lalloc->alloc(), 1, ZMutex::PSHARE);
     share->cslock = lalloc->construct(lalloc->alloc(), 1, ZMutex::PSHARE);
 
     share->arate = (zu32)(1000000.0f / arate);
     share->srate = (zu32)(1000000.0f / srate);
+    share->batch = batch;
+    share->kernel = kernel;
     share->total = (zu64)requests;
+    share->producers = nproducer;
+
+    /* Open loop arrivals keep the same nominal offered load as the closed loop, where each
+     * producer sends at the arrival rate, but on one schedule shared by all producers.
+     */
+    share->arrival = arrival;
+    share->aperiod = 1.0 / (arate * (nproducer ? nproducer : 1));
+    share->seq = 0;
+    share->lag = 0;
 
     share->qtime = 0;
     share->qweight = 0;
     share->ttime = 0;
     share->tweight = 0;
+    share->spans = 0;
+    share->tmax = 0;
+
+    // Children must not inherit cached nodes from the parent
+    jalloc->flush();
 
     ZClock clock;
+    share->start = monoSecs();
+    share->next = share->start;
 
     // start producers
     for(unsigned i = 0; i < nproducer; ++i){
@@ -210,11 +753,14 @@ int main(int argc, char **argv){
         pid_t pid = fork();
         if(pid == 0){
             // In producer child process
-            runProducer(num, share);
+            pinCpu(pcpus, num);
+            runProducer(num, share, share->stats + num);
 
             // Allocators are copied, delete the child process copies
             delete lalloc;
             delete qalloc;
+            delete talloc;
+            delete walloc;
             delete salloc;
             delete jalloc;
             delete alloc;
@@ -233,11 +779,14 @@ int main(int argc, char **argv){
         pid_t pid = fork();
         if(pid == 0){
             // In consumer child process
-            runConsumer(num, share);
+            pinCpu(ccpus, num);
+            runConsumer(num, share, share->stats + nproducer + num);
 
             // Allocators are copied, delete the child process copies
             delete lalloc;
             delete qalloc;
+            delete talloc;
+            delete walloc;
             delete salloc;
             delete jalloc;
             delete alloc;
@@ -249,31 +798,73 @@ int main(int argc, char **argv){
         }
     }
 
-    // wait for all child processes
+    // wait for all child processes, sampling live metrics in between
+    metrics.last = share->start;
+    double mnext = share->start + metrics.interval;
     while(true){
-        wait(NULL);
-        if(errno == ECHILD)
+        if(metrics.fd < 0){
+            wait(NULL);
+            if(errno == ECHILD)
+                break;
+            continue;
+        }
+
+        pid_t pid = waitpid(-1, NULL, WNOHANG);
+        if(pid < 0 && errno == ECHILD)
             break;
+        if(pid > 0)
+            continue;
+
+        double now = monoSecs();
+        if(now >= mnext){
+            sampleMetrics(&metrics, share, nproducer + nconsumer);
+            mnext += metrics.interval;
+        } else {
+            // poll for exits often enough not to skew the total run time
+            double delay = mnext - now;
+            ZThread::usleep((zu64)((delay < 0.01 ? delay : 0.01) * 1000000));
+        }
+    }
+    if(metrics.fd >= 0){
+        // final partial interval
+        sampleMetrics(&metrics, share, nproducer + nconsumer);
+        close(metrics.fd);
     }
 
     // Real world time from producers and consumers starting to all processes finishing
-    LOG("Workers Finished: " << clock.getSecs() << " seconds");
+    double wtime = clock.getSecs();
+    LOG("Workers Finished: " << wtime << " seconds");
 
-    /* Queue times are measured from when the request count is decremented by the producer to
-     * when the job is put on the work queue.
+    /* Queue times are measured from when the job is scheduled to when the job is put on the
+     * work queue. In the closed loop a job is scheduled when the producer starts its delay, in
+     * an open loop at its intended send time, so a slow queue shows up as latency instead of
+     * silently lowering the offered load.
      */
     LOG("Average Queue Time: " << share->qtime / share->qweight << " sec");
 
-    /* Request latency is measured from when the request count is decremented by the producer to
-     * to when the job is finished by the consumer.
+    /* Request latency is measured from when the job is scheduled to when the job is finished
+     * by the consumer.
      */
     LOG("Average Request Latency: " << share->ttime / share->tweight << " sec");
+    LOG("Max Request Latency: " << share->tmax << " sec");
+
+    if(arrival != ARRIVAL_CLOSED){
+        // Time producers sent jobs after their intended send time
+        LOG("Average Send Lag: " << share->lag / requests << " sec");
+    }
 
     /* Total sum request time is the total request latency from all jobs. This is not the same as CPU
-     * time spent, because the "work" done by the processes is mostly sleeping.
+     * time spent, because the "work" done by the processes is mostly sleeping, or waiting for a
+     * core with the CPU bound service kernels.
      */
     LOG("Total Sum Request Time: " << share->ttime << " sec");
 
+    /* Batching trades latency for throughput: a larger span pays the queue lock and signal
+     * once for many jobs, but every job in the span waits for the rest of it to be produced.
+     */
+    LOG("Batch Size: " << batch << ", Average Jobs per Dequeue: " << (double)share->tweight / share->spans);
+    LOG("Throughput: " << share->tweight / wtime << " jobs/sec");
+
     // lock allocator
     lalloc->destroy(share->cslock);
     lalloc->dealloc(share->cslock);
@@ -286,13 +877,25 @@ int main(int argc, char **argv){
     qalloc->dealloc(share->queue);
     delete qalloc;
 
+    // job table allocator
+    talloc->destroy(share->jobs, requests);
+    talloc->dealloc(share->jobs);
+    delete talloc;
+
+    // stats allocator
+    walloc->destroy(share->stats, nproducer + nconsumer);
+    walloc->dealloc(share->stats);
+    delete walloc;
+
     salloc->destroy(share);
     salloc->dealloc(share);
     delete salloc;
 
+    delete jalloc;
     delete alloc;
 
-    // optional, unmap shared pool
+    // optional, unmap shared pools
+    munmap(npool, nsize);
     munmap(pool, psize);
 
     return 0;
@@ -0,0 +1,143 @@
+#ifndef SLABALLOCATOR_H
+#define SLABALLOCATOR_H
+
+#include "zallocator.h"
+using namespace LibChaos;
+
+#include <atomic>
+#include <new>
+#include <type_traits>
+
+/*! Fixed-size slab allocator for objects of type T in a shared memory region.
+ *
+ *  Free slots are kept on a lock-free global free list in the region itself, a stack of slot
+ *  indices whose head carries an ABA tag in its upper 32 bits. Each process also caches up to
+ *  \a MAG slots in a private magazine, so most alloc() and dealloc() calls touch no shared
+ *  state at all, and the rest take a single compare-and-swap.
+ *
+ *  Never-used slots are handed out one at a time, so \a capacity only has to cover the
+ *  maximum number of allocations, not the magazines. The allocator must be constructed before
+ *  fork(), and flush() must be called before forking if the parent has allocated from it.
+ */
+template <typename T, zu32 MAG = 32> class SlabAllocator : public ZAllocator<T> {
+private:
+    union Slot {
+        zu32 next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type data;
+    };
+
+    struct Header {
+        //! Free list head: tag << 32 | (index + 1), low half is 0 when empty.
+        std::atomic<zu64> head;
+        //! Next never-used slot.
+        std::atomic<zu64> bump;
+        zu64 capacity;
+    };
+
+    static zu64 headerSize(){
+        return (sizeof(Header) + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+    }
+
+public:
+    //! Exact size of the shared region needed for \a capacity slots.
+    static zu64 regionSize(zu64 capacity){
+        return headerSize() + sizeof(Slot) * capacity;
+    }
+
+    SlabAllocator(void *region, zu64 capacity) :
+        _hdr(new (region) Header),
+        _slots(reinterpret_cast<Slot *>(static_cast<zbyte *>(region) + headerSize())),
+        _count(0)
+    {
+        _hdr->head.store(0);
+        _hdr->bump.store(0);
+        _hdr->capacity = capacity;
+    }
+
+    ~SlabAllocator(){
+        // Return cached slots, the region outlives this process' copy of the allocator
+        flush();
+    }
+
+    T *alloc(zu64 count = 1) override {
+        // Slots are fixed size
+        if(count != 1)
+            return nullptr;
+        if(!_count && !refill())
+            return nullptr;
+        return reinterpret_cast<T *>(&_slots[_mag[--_count]]);
+    }
+
+    void dealloc(T *ptr) override {
+        if(ptr == nullptr)
+            return;
+        if(_count == MAG)
+            flush(MAG / 2);
+        _mag[_count++] = (zu32)(reinterpret_cast<Slot *>(ptr) - _slots);
+    }
+
+    //! Return every slot cached by this process to the global free list.
+    void flush(){
+        flush(_count);
+    }
+
+private:
+    // Fill the magazine from the free list, or take one never-used slot.
+    bool refill(){
+        zu32 idx;
+        while(_count < MAG / 2 && pop(idx))
+            _mag[_count++] = idx;
+
+        if(!_count){
+            zu64 i = _hdr->bump.fetch_add(1, std::memory_order_relaxed);
+            if(i >= _hdr->capacity)
+                return false;
+            _mag[_count++] = (zu32)i;
+        }
+        return true;
+    }
+
+    bool pop(zu32 &idx){
+        zu64 head = _hdr->head.load(std::memory_order_acquire);
+        while(head & 0xFFFFFFFF){
+            zu32 i = (zu32)head - 1;
+            /* The slot may be popped and reused by another process before the swap below,
+             * making this read stale. The tag then differs and the swap fails.
+             */
+            zu32 next = __atomic_load_n(&_slots[i].next, __ATOMIC_RELAXED);
+            zu64 nhead = (((head >> 32) + 1) << 32) | next;
+            if(_hdr->head.compare_exchange_weak(head, nhead, std::memory_order_acquire, std::memory_order_acquire)){
+                idx = i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Push the top n magazine slots onto the free list as one chain.
+    void flush(zu32 n){
+        if(!n)
+            return;
+        zu32 top = _mag[_count - 1];
+        for(zu32 i = 1; i < n; ++i)
+            _slots[_mag[_count - i]].next = _mag[_count - i - 1] + 1;
+        zu32 bottom = _mag[_count - n];
+        _count -= n;
+
+        zu64 head = _hdr->head.load(std::memory_order_relaxed);
+        zu64 nhead;
+        do {
+            __atomic_store_n(&_slots[bottom].next, (zu32)head, __ATOMIC_RELAXED);
+            nhead = (((head >> 32) + 1) << 32) | (top + 1);
+        } while(!_hdr->head.compare_exchange_weak(head, nhead, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+private:
+    Header *_hdr;
+    Slot *_slots;
+    //! Per-process magazine of free slot indices.
+    zu32 _mag[MAG];
+    zu32 _count;
+};
+
+#endif // SLABALLOCATOR_H
@@ -0,0 +1,1513 @@
+#include "parceladapter.h"
+#include "parceluring.h"
+
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define PARCEL_SSSE3
+#endif
+
+namespace {
+
+struct ChunkKey {
+    uint64_t extent;
+    uint64_t chunk;
+
+    bool operator==(const ChunkKey &o) const { return extent == o.extent && chunk == o.chunk; }
+};
+
+struct ChunkKeyHash {
+    size_t operator()(const ChunkKey &k) const {
+        return std::hash<uint64_t>()(k.extent ^ k.chunk * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+/* Least recently used are dropped first, capacity is in bytes as reported by T::size().
+ * Readers hold a reference, so a value evicted while it is in use stays valid.
+ */
+template<class T>
+class LruCache {
+public:
+    typedef std::shared_ptr<const T> Value;
+
+    LruCache(size_t capacity) : _size(0), _capacity(capacity){}
+
+    Value get(const ChunkKey &key){
+        std::lock_guard<std::mutex> lock(_lock);
+        auto it = _map.find(key);
+        if(it == _map.end())
+            return Value();
+        _lru.splice(_lru.begin(), _lru, it->second);
+        return it->second->second;
+    }
+
+    void put(const ChunkKey &key, const Value &value){
+        std::lock_guard<std::mutex> lock(_lock);
+        if(value->size() > _capacity || _map.count(key))
+            return;
+        _lru.emplace_front(key, value);
+        _map[key] = _lru.begin();
+        _size += value->size();
+        evict();
+    }
+
+    void resize(size_t capacity){
+        std::lock_guard<std::mutex> lock(_lock);
+        _capacity = capacity;
+        evict();
+    }
+
+private:
+    void evict(){
+        while(_size > _capacity){
+            _size -= _lru.back().second->size();
+            _map.erase(_lru.back().first);
+            _lru.pop_back();
+        }
+    }
+
+    std::mutex _lock;
+    size_t _size;
+    size_t _capacity;
+    std::list<std::pair<ChunkKey, Value>> _lru;    // most recently used first
+    std::unordered_map<ChunkKey, typename std::list<std::pair<ChunkKey, Value>>::iterator, ChunkKeyHash> _map;
+};
+
+//! Decompressed chunks of compressed extents, by extent offset and chunk number.
+typedef LruCache<std::vector<uint8_t>> ChunkCache;
+typedef ChunkCache::Value Chunk;
+
+//! The parts of a name index read on every lookup: header, Bloom filter and restarts.
+struct NameIndex {
+    struct parcel_node node;
+    std::vector<uint8_t> head;
+    uint32_t count;
+    uint32_t bloombytes;
+    uint8_t hashes;
+    uint32_t restarts;
+
+    size_t size() const { return sizeof(*this) + head.size(); }
+    uint32_t restart(uint32_t i) const {
+        return parcel_get32(head.data() + PARCEL_NAMEINDEX_HEADER + bloombytes + i * 4);
+    }
+};
+
+//! Name indexes by the offset of their list node.
+typedef LruCache<NameIndex> NameIndexCache;
+
+}
+
+struct parcel {
+    int fd;
+    bool writable;
+    struct parcel_super sb;
+    //! The index root is read on every lookup, so it is kept in memory.
+    uint8_t root[PARCEL_BLOCK];
+    ChunkCache cache;
+    NameIndexCache names;
+    ParcelRing *ring;           //!< Asynchronous reads, once started.
+    std::mutex pendingLock;
+    std::unordered_set<ChunkKey, ChunkKeyHash> pending;    //!< Chunks being read ahead.
+
+    // In-memory uid index of a v1 image, from parcel_load_index()
+    bool indexed;
+    const uint8_t *entries;     //!< Sorted, PARCEL_INDEX_ENTRY bytes each.
+    uint64_t entrycount;
+    void *snapmap;              //!< The mapped snapshot the entries are in, or NULL.
+    size_t snapmaplen;
+    std::vector<uint8_t> rebuilt;
+
+    parcel() : cache(256 * PARCEL_CHUNK), names(16 << 20), ring(NULL), indexed(false), entries(NULL), entrycount(0),
+               snapmap(NULL), snapmaplen(0){}
+};
+
+// //////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+struct CrcTable {
+    uint32_t table[256];
+    CrcTable(){
+        for(uint32_t i = 0; i < 256; ++i){
+            uint32_t c = i;
+            for(int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+};
+
+//! pread() all of size bytes, returns 0 or -EIO.
+int readAt(int fd, void *buf, size_t size, uint64_t off){
+    uint8_t *p = (uint8_t *)buf;
+    while(size > 0){
+        ssize_t n = pread(fd, p, size, off);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -EIO;
+        p += n;
+        size -= n;
+        off += n;
+    }
+    return 0;
+}
+
+//! pwrite() all of size bytes, returns 0 or -EIO.
+int writeAt(int fd, const void *buf, size_t size, uint64_t off){
+    const uint8_t *p = (const uint8_t *)buf;
+    while(size > 0){
+        ssize_t n = pwrite(fd, p, size, off);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -EIO;
+        p += n;
+        size -= n;
+        off += n;
+    }
+    return 0;
+}
+
+int writeSuper(struct parcel *pc){
+    uint8_t data[PARCEL_EXT_OFFSET + PARCEL_EXT_SIZE];
+    parcel_encode_super(&pc->sb, data);
+    return writeAt(pc->fd, data, pc->sb.version >= PARCEL_V2 ? sizeof(data) : PARCEL_SUPER_SIZE, 0);
+}
+
+int readNode(struct parcel *pc, uint64_t off, struct parcel_node *node){
+    uint8_t data[PARCEL_NODE_SIZE];
+    if(readAt(pc->fd, data, sizeof(data), off) != 0)
+        return -EIO;
+    parcel_parse_treenode(node, data);
+    node->offset = off;
+    return node->magic == PARCEL_TREE_MAGIC ? 0 : -EIO;
+}
+
+//! Index descent, one block read per level below the root.
+int findIndexed(struct parcel *pc, const uint8_t *uid, struct parcel_node *node){
+    if(pc->sb.nodecount == 0)
+        return -ENOENT;
+
+    uint8_t buf[PARCEL_BLOCK];
+    const uint8_t *block = pc->root;
+    uint64_t off = 0;
+    for(int level = pc->sb.indexdepth - 1; ; --level){
+        if(parcel_get32(block) != PARCEL_INDEX_MAGIC || block[6] != level)
+            return -EIO;
+        off = parcel_index_search(block, uid);
+        if(off == 0)
+            return -ENOENT;
+        if(level == 0)
+            break;
+        if(readAt(pc->fd, buf, PARCEL_BLOCK, off) != 0)
+            return -EIO;
+        block = buf;
+    }
+
+    int ret = readNode(pc, off, node);
+    if(ret == 0 && memcmp(node->uid, uid, PARCEL_UID_SIZE) != 0)
+        return -EIO;
+    return ret;
+}
+
+//! v1 lookup, one dependent node read per tree level.
+int findTree(struct parcel *pc, const uint8_t *uid, struct parcel_node *node){
+    uint64_t off = pc->sb.treehead;
+    while(off != 0){
+        if(readNode(pc, off, node) != 0)
+            return -EIO;
+        int cmp = memcmp(uid, node->uid, PARCEL_UID_SIZE);
+        if(cmp == 0)
+            return 0;
+        off = cmp < 0 ? node->lnode : node->rnode;
+    }
+    return -ENOENT;
+}
+
+//! v2 nodes are contiguous, so a walk is one sequential read.
+int walkRun(struct parcel *pc, int (*fn)(const struct parcel_node *, void *), void *arg){
+    const uint64_t chunk = 1024;
+    std::vector<uint8_t> buf(chunk * PARCEL_NODE_SIZE);
+    struct parcel_node node;
+
+    for(uint64_t i = 0; i < pc->sb.nodecount; i += chunk){
+        uint64_t n = pc->sb.nodecount - i < chunk ? pc->sb.nodecount - i : chunk;
+        uint64_t off = pc->sb.nodestart + i * PARCEL_NODE_SIZE;
+        if(readAt(pc->fd, buf.data(), n * PARCEL_NODE_SIZE, off) != 0)
+            return -EIO;
+        for(uint64_t k = 0; k < n; ++k){
+            parcel_parse_treenode(&node, buf.data() + k * PARCEL_NODE_SIZE);
+            node.offset = off + k * PARCEL_NODE_SIZE;
+            if(node.magic != PARCEL_TREE_MAGIC)
+                return -EIO;
+            int ret = fn(&node, arg);
+            if(ret != 0)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+void decodeNode(struct parcel_node_batch *b, size_t i, const uint8_t *p){
+    memcpy(b->uid[i], p + 4, PARCEL_UID_SIZE);
+    b->lnode[i] = parcel_get64(p + 20);
+    b->rnode[i] = parcel_get64(p + 28);
+    b->type[i] = p[36];
+    b->extra[i] = p[37];
+    if(parcel_is_inline(p[36], p[37])){
+        b->offset[i] = 0;
+        b->size[i] = parcel_inline_size(p[37]);
+    } else if(p[36] >= PARCEL_BLOB){
+        b->offset[i] = parcel_get64(p + 42);
+        b->size[i] = parcel_get64(p + 50);
+    } else {
+        b->offset[i] = b->size[i] = 0;
+    }
+}
+
+size_t decodeScalar(struct parcel_node_batch *b, const uint8_t *data, size_t count){
+    size_t i;
+    for(i = 0; i < count; ++i){
+        const uint8_t *p = data + i * PARCEL_NODE_SIZE;
+        if(parcel_get32(p) != PARCEL_TREE_MAGIC)
+            break;
+        decodeNode(b, i, p);
+    }
+    return i;
+}
+
+#ifdef PARCEL_SSSE3
+
+/* Each pair of 64-bit fields (lnode/rnode, data offset/size) is one unaligned 16 byte load
+ * and one shuffle that byte swaps both, and the uid is one load and store.
+ */
+__attribute__((target("ssse3")))
+size_t decodeSsse3(struct parcel_node_batch *b, const uint8_t *data, size_t count){
+    const __m128i swap = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+    size_t i;
+    for(i = 0; i < count; ++i){
+        const uint8_t *p = data + i * PARCEL_NODE_SIZE;
+        if(parcel_get32(p) != PARCEL_TREE_MAGIC)
+            break;
+
+        __m128i uid = _mm_loadu_si128((const __m128i *)(p + 4));
+        __m128i links = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 20)), swap);
+        __m128i extent = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 42)), swap);
+        uint8_t type = p[36];
+        // Types without out of line data get a zero extent, without a branch
+        extent = _mm_and_si128(extent, _mm_set1_epi8(type >= PARCEL_BLOB ? -1 : 0));
+
+        _mm_storeu_si128((__m128i *)b->uid[i], uid);
+        _mm_storel_epi64((__m128i *)&b->lnode[i], links);
+        _mm_storel_epi64((__m128i *)&b->rnode[i], _mm_unpackhi_epi64(links, links));
+        _mm_storel_epi64((__m128i *)&b->offset[i], extent);
+        _mm_storel_epi64((__m128i *)&b->size[i], _mm_unpackhi_epi64(extent, extent));
+        b->type[i] = type;
+        b->extra[i] = p[37];
+        if(parcel_is_inline(type, p[37])){
+            b->offset[i] = 0;
+            b->size[i] = parcel_inline_size(p[37]);
+        }
+    }
+    return i;
+}
+
+#endif
+
+//! v2 scan, the node run is read and decoded a batch at a time.
+int scanRun(struct parcel *pc, int (*fn)(const struct parcel_node_batch *, uint64_t, void *), void *arg){
+    const uint64_t chunk = 4096;
+    struct parcel_node_batch batch;
+    if(parcel_batch_init(&batch, chunk) != 0)
+        return -ENOMEM;
+    std::vector<uint8_t> buf(chunk * PARCEL_NODE_SIZE);
+
+    int ret = 0;
+    for(uint64_t i = 0; i < pc->sb.nodecount && ret == 0; i += chunk){
+        uint64_t n = pc->sb.nodecount - i < chunk ? pc->sb.nodecount - i : chunk;
+        if(readAt(pc->fd, buf.data(), n * PARCEL_NODE_SIZE, pc->sb.nodestart + i * PARCEL_NODE_SIZE) != 0 ||
+           parcel_parse_treenodes(&batch, buf.data(), n) != n){
+            ret = -EIO;
+            break;
+        }
+        ret = fn(&batch, i, arg);
+    }
+    parcel_batch_free(&batch);
+    return ret;
+}
+
+struct ScanTree {
+    struct parcel_node_batch batch;
+    uint64_t first;
+    int (*fn)(const struct parcel_node_batch *, uint64_t, void *);
+    void *arg;
+};
+
+int scanTreeNode(const struct parcel_node *node, void *arg){
+    ScanTree *st = (ScanTree *)arg;
+    struct parcel_node_batch *b = &st->batch;
+    size_t i = b->count++;
+    memcpy(b->uid[i], node->uid, PARCEL_UID_SIZE);
+    b->lnode[i] = node->lnode;
+    b->rnode[i] = node->rnode;
+    b->type[i] = node->type;
+    b->extra[i] = node->extra;
+    b->offset[i] = node->data.offset;
+    b->size[i] = node->data.size;
+
+    if(b->count < b->capacity)
+        return 0;
+    int ret = st->fn(b, st->first, st->arg);
+    st->first += b->count;
+    b->count = 0;
+    return ret;
+}
+
+//! Uncompressed size of chunk c, only the last chunk of an extent is short.
+size_t chunkSize(const struct parcel_node *node, uint64_t c){
+    return node->data.size - c * PARCEL_CHUNK < PARCEL_CHUNK ? node->data.size - c * PARCEL_CHUNK : PARCEL_CHUNK;
+}
+
+/* Read from a compressed extent. Only the chunks covering the range are read, each with its
+ * two chunk table entries, and decompressed chunks go through the cache.
+ */
+int readCompressed(struct parcel *pc, const struct parcel_node *node, uint8_t *buf, size_t size, uint64_t off){
+    uint64_t nchunks = (node->data.size + PARCEL_CHUNK - 1) / PARCEL_CHUNK;
+    uint64_t base = node->data.offset + nchunks * 4;
+    std::vector<uint8_t> stored;
+
+    while(size > 0){
+        uint64_t c = off / PARCEL_CHUNK;
+        size_t skip = off % PARCEL_CHUNK;
+        size_t raw = chunkSize(node, c);
+        size_t n = raw - skip < size ? raw - skip : size;
+
+        ChunkKey key = { node->data.offset, c };
+        Chunk chunk = pc->cache.get(key);
+        if(!chunk){
+            uint8_t ends[8];
+            uint32_t start = 0;
+            uint32_t end;
+            if(c == 0){
+                if(readAt(pc->fd, ends, 4, node->data.offset) != 0)
+                    return -EIO;
+                end = parcel_get32(ends);
+            } else {
+                if(readAt(pc->fd, ends, 8, node->data.offset + (c - 1) * 4) != 0)
+                    return -EIO;
+                start = parcel_get32(ends);
+                end = parcel_get32(ends + 4);
+            }
+            if(end < start || end - start > raw)
+                return -EIO;
+
+            // Chunks that did not compress are read straight into the caller's buffer
+            if(end - start == raw){
+                if(readAt(pc->fd, buf, n, base + start + skip) != 0)
+                    return -EIO;
+                buf += n;
+                off += n;
+                size -= n;
+                continue;
+            }
+
+            stored.resize(end - start);
+            if(readAt(pc->fd, stored.data(), stored.size(), base + start) != 0)
+                return -EIO;
+            std::shared_ptr<std::vector<uint8_t>> out = std::make_shared<std::vector<uint8_t>>(raw);
+            if(parcel_lz4_decompress(stored.data(), stored.size(), out->data(), raw) != (long)raw)
+                return -EIO;
+            chunk = out;
+            pc->cache.put(key, chunk);
+        }
+
+        memcpy(buf, chunk->data() + skip, n);
+        buf += n;
+        off += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/* Read from a plain extent when readahead left all chunks of the range in the cache. Returns
+ * false on the first miss, plain extents are not cached otherwise.
+ */
+bool readCached(struct parcel *pc, const struct parcel_node *node, uint8_t *buf, size_t size, uint64_t off){
+    while(size > 0){
+        uint64_t c = off / PARCEL_CHUNK;
+        size_t skip = off % PARCEL_CHUNK;
+        size_t n = chunkSize(node, c) - skip < size ? chunkSize(node, c) - skip : size;
+
+        ChunkKey key = { node->data.offset, c };
+        Chunk chunk = pc->cache.get(key);
+        if(!chunk)
+            return false;
+        memcpy(buf, chunk->data() + skip, n);
+        buf += n;
+        off += n;
+        size -= n;
+    }
+    return true;
+}
+
+//! Chunks read ahead with one request at most.
+const uint64_t READAHEAD_RUN = 16;
+
+/* A run of chunks read ahead with one ring read. Compressed runs first read their chunk table
+ * entries, then the stored chunks, and are decompressed on the completion thread.
+ */
+struct Readahead {
+    struct parcel *pc;
+    struct parcel_node node;
+    uint64_t first;
+    uint64_t count;
+    std::vector<uint32_t> ends;     //!< Compressed: start of the run, then the end of each chunk.
+};
+
+void readaheadFinish(Readahead *ra){
+    std::lock_guard<std::mutex> lock(ra->pc->pendingLock);
+    for(uint64_t c = ra->first; c < ra->first + ra->count; ++c){
+        ChunkKey key = { ra->node.data.offset, c };
+        ra->pc->pending.erase(key);
+    }
+    delete ra;
+}
+
+void readaheadData(void *arg, const void *data, ssize_t result){
+    Readahead *ra = (Readahead *)arg;
+    struct parcel *pc = ra->pc;
+    const uint8_t *p = (const uint8_t *)data;
+    bool compressed = ra->node.extra & PARCEL_EXTRA_COMPRESSED;
+
+    for(uint64_t i = 0; result >= 0 && i < ra->count; ++i){
+        ChunkKey key = { ra->node.data.offset, ra->first + i };
+        size_t raw = chunkSize(&ra->node, key.chunk);
+        std::shared_ptr<std::vector<uint8_t>> out;
+        if(pc->cache.get(key)){
+            // A read got there first
+            p += raw;
+            continue;
+        }
+        if(!compressed){
+            out = std::make_shared<std::vector<uint8_t>>(p, p + raw);
+            p += raw;
+        } else {
+            const uint8_t *stored = (const uint8_t *)data + (ra->ends[i] - ra->ends[0]);
+            size_t n = ra->ends[i + 1] - ra->ends[i];
+            if(n == raw)
+                out = std::make_shared<std::vector<uint8_t>>(stored, stored + raw);
+            else {
+                out = std::make_shared<std::vector<uint8_t>>(raw);
+                if(parcel_lz4_decompress(stored, n, out->data(), raw) != (long)raw)
+                    break;
+            }
+        }
+        pc->cache.put(key, out);
+    }
+    readaheadFinish(ra);
+}
+
+void readaheadEnds(void *arg, const void *data, ssize_t result){
+    Readahead *ra = (Readahead *)arg;
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t nchunks = (ra->node.data.size + PARCEL_CHUNK - 1) / PARCEL_CHUNK;
+    uint64_t base = ra->node.data.offset + nchunks * 4;
+
+    if(result < 0){
+        readaheadFinish(ra);
+        return;
+    }
+    ra->ends.push_back(ra->first == 0 ? 0 : parcel_get32(p));
+    for(uint64_t i = 0; i < ra->count; ++i){
+        uint32_t end = parcel_get32(p + (ra->first == 0 ? i : i + 1) * 4);
+        if(end < ra->ends.back() || end - ra->ends.back() > chunkSize(&ra->node, ra->first + i)){
+            readaheadFinish(ra);
+            return;
+        }
+        ra->ends.push_back(end);
+    }
+    if(!ra->pc->ring->read(base + ra->ends[0], ra->ends.back() - ra->ends[0], readaheadData, ra, true))
+        readaheadFinish(ra);
+}
+
+//! Start reading count chunks from first, which were marked pending.
+void readaheadRun(struct parcel *pc, const struct parcel_node *node, uint64_t first, uint64_t count){
+    Readahead *ra = new Readahead;
+    ra->pc = pc;
+    ra->node = *node;
+    ra->first = first;
+    ra->count = count;
+
+    bool queued;
+    if(node->extra & PARCEL_EXTRA_COMPRESSED){
+        uint64_t from = first == 0 ? 0 : first - 1;
+        queued = pc->ring->read(node->data.offset + from * 4, (first + count - from) * 4, readaheadEnds, ra, true);
+    } else {
+        uint64_t off = first * PARCEL_CHUNK;
+        uint64_t end = (first + count) * PARCEL_CHUNK < node->data.size ? (first + count) * PARCEL_CHUNK : node->data.size;
+        queued = pc->ring->read(node->data.offset + off, end - off, readaheadData, ra, true);
+    }
+    if(!queued)
+        readaheadFinish(ra);
+}
+
+int loadNameIndex(struct parcel *pc, const struct parcel_node *dir, std::shared_ptr<const NameIndex> &out){
+    ChunkKey key = { dir->offset, 0 };
+    out = pc->names.get(key);
+    if(out)
+        return 0;
+
+    std::shared_ptr<NameIndex> ni = std::make_shared<NameIndex>();
+    uint8_t uid[PARCEL_UID_SIZE];
+    uint8_t header[PARCEL_NAMEINDEX_HEADER];
+    parcel_nameindex_uid(dir->uid, uid);
+    if(parcel_find(pc, uid, &ni->node) != 0 || ni->node.type != PARCEL_NAMEINDEX ||
+       parcel_read(pc, &ni->node, header, sizeof(header), 0) != sizeof(header) ||
+       parcel_get32(header) != PARCEL_NAMEINDEX_MAGIC)
+        return -EIO;
+
+    ni->count = parcel_get32(header + 4);
+    ni->bloombytes = parcel_get32(header + 8);
+    ni->hashes = header[12];
+    uint8_t interval = header[13];
+    if(interval == 0 || ni->bloombytes == 0)
+        return -EIO;
+    ni->restarts = (ni->count + interval - 1) / interval;
+    uint64_t size = PARCEL_NAMEINDEX_HEADER + ni->bloombytes + (uint64_t)ni->restarts * 4;
+    if(size > ni->node.data.size)
+        return -EIO;
+    ni->head.resize(size);
+    if(parcel_read(pc, &ni->node, ni->head.data(), size, 0) != (ssize_t)size)
+        return -EIO;
+
+    out = ni;
+    pc->names.put(key, out);
+    return 0;
+}
+
+//! Three way compare of a name with an index key.
+int compareName(const char *name, size_t len, const uint8_t *key, size_t keylen){
+    int cmp = memcmp(name, key, len < keylen ? len : keylen);
+    if(cmp != 0)
+        return cmp;
+    return len < keylen ? -1 : len > keylen;
+}
+
+//! Binary search of the extent table, pos is set to the entry's offset.
+int findExtent(struct parcel *pc, const uint8_t *hash, struct parcel_extent *ext, uint64_t *pos){
+    uint8_t data[PARCEL_EXTENT_ENTRY];
+    uint64_t lo = 0;
+    uint64_t hi = pc->sb.extentcount;
+    while(lo < hi){
+        uint64_t mid = lo + (hi - lo) / 2;
+        uint64_t off = pc->sb.extenttable + mid * PARCEL_EXTENT_ENTRY;
+        if(readAt(pc->fd, data, sizeof(data), off) != 0)
+            return -EIO;
+        int cmp = memcmp(data, hash, PARCEL_HASH_SIZE);
+        if(cmp == 0){
+            parcel_parse_extent(ext, data);
+            *pos = off;
+            return 0;
+        }
+        if(cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -ENOENT;
+}
+
+/* Append an unreferenced extent to the free list. Extents too small to hold a free node are
+ * left for the next rebuild to drop.
+ */
+int freeExtent(struct parcel *pc, const struct parcel_extent *ext){
+    if(ext->size < PARCEL_FREE_SIZE)
+        return 0;
+
+    uint8_t data[PARCEL_FREE_SIZE];
+    struct parcel_free_node fn;
+    fn.offset = ext->offset;
+    fn.magic = PARCEL_FREE_MAGIC;
+    fn.next = 0;
+    fn.size = ext->size;
+    parcel_encode_freenode(&fn, data);
+    if(writeAt(pc->fd, data, sizeof(data), fn.offset) != 0)
+        return -EIO;
+
+    if(pc->sb.freetail != 0){
+        struct parcel_free_node tail;
+        if(readAt(pc->fd, data, sizeof(data), pc->sb.freetail) != 0)
+            return -EIO;
+        parcel_parse_freenode(&tail, data);
+        if(tail.magic != PARCEL_FREE_MAGIC)
+            return -EIO;
+        tail.offset = pc->sb.freetail;
+        tail.next = fn.offset;
+        parcel_encode_freenode(&tail, data);
+        if(writeAt(pc->fd, data, sizeof(data), tail.offset) != 0)
+            return -EIO;
+    } else {
+        pc->sb.freehead = fn.offset;
+    }
+    pc->sb.freetail = fn.offset;
+    return writeSuper(pc);
+}
+
+//! Binary search of the in-memory index, which is checked against the node it points to.
+int findSnapshot(struct parcel *pc, const uint8_t *uid, struct parcel_node *node){
+    uint64_t lo = 0;
+    uint64_t hi = pc->entrycount;
+    while(lo < hi){
+        uint64_t mid = lo + (hi - lo) / 2;
+        const uint8_t *e = pc->entries + mid * PARCEL_INDEX_ENTRY;
+        int cmp = memcmp(uid, e, PARCEL_UID_SIZE);
+        if(cmp == 0){
+            if(readNode(pc, parcel_get64(e + PARCEL_UID_SIZE), node) != 0 || memcmp(node->uid, uid, PARCEL_UID_SIZE) != 0)
+                return -EIO;
+            return 0;
+        }
+        if(cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return -ENOENT;
+}
+
+/* Map the snapshot at tail if it is intact and was made for this tree generation. Returns 0,
+ * or -ESTALE if the tree needs to be walked.
+ */
+int mapSnapshot(struct parcel *pc){
+    uint8_t head[PARCEL_SNAPSHOT_HEADER];
+    struct stat st;
+    if(!(pc->sb.flags & PARCEL_FLAG_SNAPSHOT) || fstat(pc->fd, &st) != 0 ||
+       (uint64_t)st.st_size < pc->sb.tail + sizeof(head) ||
+       readAt(pc->fd, head, sizeof(head), pc->sb.tail) != 0)
+        return -ESTALE;
+
+    uint64_t count = parcel_get64(head + 16);
+    if(parcel_get32(head) != PARCEL_SNAPSHOT_MAGIC ||
+       parcel_get32(head + 28) != parcel_crc32(0, head, 28) ||
+       parcel_get64(head + 8) != parcel_tree_generation(&pc->sb) ||
+       count > ((uint64_t)st.st_size - pc->sb.tail - sizeof(head)) / PARCEL_INDEX_ENTRY)
+        return -ESTALE;
+
+    // Mappings start on a page, the snapshot wherever tail was
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = pc->sb.tail / page * page;
+    size_t len = pc->sb.tail - start + sizeof(head) + count * PARCEL_INDEX_ENTRY;
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, pc->fd, start);
+    if(map == MAP_FAILED)
+        return -ESTALE;
+
+    const uint8_t *entries = (const uint8_t *)map + (pc->sb.tail - start) + sizeof(head);
+    if(parcel_crc32(0, entries, count * PARCEL_INDEX_ENTRY) != parcel_get32(head + 4)){
+        munmap(map, len);
+        return -ESTALE;
+    }
+    pc->snapmap = map;
+    pc->snapmaplen = len;
+    pc->indexed = true;
+    pc->entries = entries;
+    pc->entrycount = count;
+    return 0;
+}
+
+/* Walk the tree from treehead with several threads. The top levels are expanded breadth first
+ * until there are a few subtrees per thread, then each thread takes subtrees off the list and
+ * walks them depth first. Entries are sorted by uid at the end.
+ */
+int rebuildIndex(struct parcel *pc, unsigned threads){
+    struct stat st;
+    if(fstat(pc->fd, &st) != 0)
+        return -EIO;
+    // More nodes than fit in the image means a cycle
+    uint64_t limit = st.st_size / PARCEL_NODE_SIZE;
+
+    std::vector<uint8_t> top;
+    std::vector<uint64_t> roots;
+    if(pc->sb.treehead != 0)
+        roots.push_back(pc->sb.treehead);
+    while(!roots.empty() && roots.size() < threads * 4){
+        std::vector<uint64_t> next;
+        for(uint64_t off : roots){
+            struct parcel_node node;
+            if(readNode(pc, off, &node) != 0 || top.size() / PARCEL_INDEX_ENTRY >= limit)
+                return -EIO;
+            top.insert(top.end(), node.uid, node.uid + PARCEL_UID_SIZE);
+            top.resize(top.size() + 8);
+            parcel_put64(top.data() + top.size() - 8, off);
+            if(node.lnode != 0)
+                next.push_back(node.lnode);
+            if(node.rnode != 0)
+                next.push_back(node.rnode);
+        }
+        roots.swap(next);
+    }
+
+    std::vector<std::vector<uint8_t>> found(threads);
+    std::atomic<size_t> nextRoot(0);
+    std::atomic<uint64_t> total(top.size() / PARCEL_INDEX_ENTRY);
+    std::atomic<bool> failed(false);
+    auto work = [&](unsigned t){
+        std::vector<uint64_t> stack;
+        for(size_t r; !failed && (r = nextRoot++) < roots.size(); ){
+            stack.push_back(roots[r]);
+            while(!stack.empty() && !failed){
+                struct parcel_node node;
+                uint64_t off = stack.back();
+                stack.pop_back();
+                if(readNode(pc, off, &node) != 0 || ++total > limit){
+                    failed = true;
+                    break;
+                }
+                found[t].insert(found[t].end(), node.uid, node.uid + PARCEL_UID_SIZE);
+                found[t].resize(found[t].size() + 8);
+                parcel_put64(found[t].data() + found[t].size() - 8, off);
+                if(node.rnode != 0)
+                    stack.push_back(node.rnode);
+                if(node.lnode != 0)
+                    stack.push_back(node.lnode);
+            }
+            stack.clear();
+        }
+    };
+    std::vector<std::thread> workers;
+    for(unsigned t = 1; t < threads && t < roots.size(); ++t)
+        workers.emplace_back(work, t);
+    work(0);
+    for(std::thread &w : workers)
+        w.join();
+    if(failed)
+        return -EIO;
+
+    // Sort whole entries through an index, they are not a type std::sort can move
+    std::vector<const uint8_t *> order;
+    order.reserve(total);
+    for(size_t i = 0; i < top.size(); i += PARCEL_INDEX_ENTRY)
+        order.push_back(top.data() + i);
+    for(const std::vector<uint8_t> &f : found)
+        for(size_t i = 0; i < f.size(); i += PARCEL_INDEX_ENTRY)
+            order.push_back(f.data() + i);
+    std::sort(order.begin(), order.end(), [](const uint8_t *a, const uint8_t *b){
+        return memcmp(a, b, PARCEL_UID_SIZE) < 0;
+    });
+
+    pc->rebuilt.resize(order.size() * PARCEL_INDEX_ENTRY);
+    for(size_t i = 0; i < order.size(); ++i)
+        memcpy(pc->rebuilt.data() + i * PARCEL_INDEX_ENTRY, order[i], PARCEL_INDEX_ENTRY);
+    pc->indexed = true;
+    pc->entries = pc->rebuilt.data();
+    pc->entrycount = order.size();
+    return 0;
+}
+
+//! In-order walk of the v1 tree, without recursion since the tree may be unbalanced.
+int walkTree(struct parcel *pc, int (*fn)(const struct parcel_node *, void *), void *arg){
+    std::vector<struct parcel_node> stack;
+    uint64_t off = pc->sb.treehead;
+    while(off != 0 || !stack.empty()){
+        while(off != 0){
+            stack.emplace_back();
+            if(readNode(pc, off, &stack.back()) != 0)
+                return -EIO;
+            off = stack.back().lnode;
+        }
+        struct parcel_node node = stack.back();
+        stack.pop_back();
+        int ret = fn(&node, arg);
+        if(ret != 0)
+            return ret;
+        off = node.rnode;
+    }
+    return 0;
+}
+
+}
+
+// //////////////////////////////////////////////////////////////////////////
+
+uint32_t parcel_crc32(uint32_t crc, const void *data, size_t len){
+    static const CrcTable crctab;
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    for(size_t i = 0; i < len; ++i)
+        crc = crctab.table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void parcel_parse_super(struct parcel_super *sb, const uint8_t *data){
+    sb->magic =     parcel_get32(data);
+    sb->version =   data[7];
+    sb->flags =     parcel_get32(data + 8);
+    sb->treehead =  parcel_get64(data + 12);
+    sb->freehead =  parcel_get64(data + 20);
+    sb->freetail =  parcel_get64(data + 28);
+    sb->tail =      parcel_get64(data + 36);
+    memcpy(sb->rootid, data + 44, 16);
+    sb->crc =       parcel_get32(data + 60);
+
+    sb->indexroot = sb->nodecount = sb->nodestart = 0;
+    sb->extenttable = sb->extentcount = 0;
+    sb->indexdepth = 0;
+    sb->extcrc = 0;
+    if(sb->version >= PARCEL_V2){
+        const uint8_t *ext = data + PARCEL_EXT_OFFSET;
+        sb->indexroot =     parcel_get64(ext);
+        sb->nodecount =     parcel_get64(ext + 8);
+        sb->nodestart =     parcel_get64(ext + 16);
+        sb->indexdepth =    ext[24];
+        sb->extenttable =   parcel_get64(ext + 32);
+        sb->extentcount =   parcel_get64(ext + 40);
+        sb->extcrc =        parcel_get32(ext + 60);
+    }
+}
+
+uint32_t parcel_tree_generation(const struct parcel_super *sb){
+    uint8_t data[PARCEL_EXT_OFFSET + PARCEL_EXT_SIZE];
+    parcel_encode_super(sb, data);
+    return parcel_crc32(0, data + 12, 48);     // treehead to rootid
+}
+
+// The v2 extension is only written for v2, in v1 images tree nodes follow the superblock
+void parcel_encode_super(const struct parcel_super *sb, uint8_t *data){
+    memset(data, 0, PARCEL_SUPER_SIZE);
+    parcel_put32(data, sb->magic);
+    data[7] = sb->version;
+    parcel_put32(data + 8, sb->flags);
+    parcel_put64(data + 12, sb->treehead);
+    parcel_put64(data + 20, sb->freehead);
+    parcel_put64(data + 28, sb->freetail);
+    parcel_put64(data + 36, sb->tail);
+    memcpy(data + 44, sb->rootid, 16);
+    parcel_put32(data + 60, parcel_crc32(0, data, 60));
+    if(sb->version < PARCEL_V2)
+        return;
+
+    uint8_t *ext = data + PARCEL_EXT_OFFSET;
+    memset(ext, 0, PARCEL_EXT_SIZE);
+    parcel_put64(ext, sb->indexroot);
+    parcel_put64(ext + 8, sb->nodecount);
+    parcel_put64(ext + 16, sb->nodestart);
+    ext[24] = sb->indexdepth;
+    parcel_put64(ext + 32, sb->extenttable);
+    parcel_put64(ext + 40, sb->extentcount);
+    parcel_put32(ext + 60, parcel_crc32(0, ext, 60));
+}
+
+void parcel_parse_treenode(struct parcel_node *tn, const uint8_t *data){
+    tn->magic =     parcel_get32(data);
+    memcpy(tn->uid, data + 4, 16);
+    tn->lnode =     parcel_get64(data + 20);
+    tn->rnode =     parcel_get64(data + 28);
+    tn->type =      data[36];
+    tn->extra =     data[37];
+    tn->crc =       parcel_get32(data + 38);
+    memcpy(tn->payload, data + 42, 16);
+
+    tn->data.offset = tn->data.size = 0;
+    if(parcel_is_inline(tn->type, tn->extra)){
+        tn->data.size = parcel_inline_size(tn->extra);
+    } else if(tn->type >= PARCEL_BLOB){
+        tn->data.offset =   parcel_get64(tn->payload);
+        tn->data.size =     parcel_get64(tn->payload + 8);
+    }
+}
+
+// The node checksum covers every field but itself. Inline data is already in the payload.
+void parcel_encode_treenode(struct parcel_node *tn, uint8_t *data){
+    if(tn->type >= PARCEL_BLOB && !(tn->extra & PARCEL_EXTRA_INLINE)){
+        parcel_put64(tn->payload, tn->data.offset);
+        parcel_put64(tn->payload + 8, tn->data.size);
+    }
+    parcel_put32(data, tn->magic);
+    memcpy(data + 4, tn->uid, 16);
+    parcel_put64(data + 20, tn->lnode);
+    parcel_put64(data + 28, tn->rnode);
+    data[36] = tn->type;
+    data[37] = tn->extra;
+    memcpy(data + 42, tn->payload, 16);
+    tn->crc = parcel_crc32(parcel_crc32(0, data, 38), data + 42, 16);
+    parcel_put32(data + 38, tn->crc);
+}
+
+void parcel_parse_freenode(struct parcel_free_node *fn, const uint8_t *data){
+    fn->magic = parcel_get32(data);
+    fn->next =  parcel_get64(data + 4);
+    fn->size =  parcel_get64(data + 12);
+    fn->crc =   parcel_get32(data + 20);
+}
+
+void parcel_encode_freenode(struct parcel_free_node *fn, uint8_t *data){
+    parcel_put32(data, fn->magic);
+    parcel_put64(data + 4, fn->next);
+    parcel_put64(data + 12, fn->size);
+    fn->crc = parcel_crc32(0, data, 20);
+    parcel_put32(data + 20, fn->crc);
+}
+
+void parcel_parse_extent(struct parcel_extent *ext, const uint8_t *data){
+    memcpy(ext->hash, data, PARCEL_HASH_SIZE);
+    ext->offset =   parcel_get64(data + 16);
+    ext->size =     parcel_get64(data + 24);
+    ext->refs =     parcel_get32(data + 32);
+}
+
+void parcel_encode_extent(const struct parcel_extent *ext, uint8_t *data){
+    memcpy(data, ext->hash, PARCEL_HASH_SIZE);
+    parcel_put64(data + 16, ext->offset);
+    parcel_put64(data + 24, ext->size);
+    parcel_put32(data + 32, ext->refs);
+}
+
+// //////////////////////////////////////////////////////////////////////////
+
+static const uint64_t HASH_C1 = 0x87c37b91114253d5ULL;
+static const uint64_t HASH_C2 = 0x4cf5ad432745937fULL;
+
+static inline uint64_t rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k){
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// Hash input is read little endian on every host, so hashes stored in images are portable
+static inline uint64_t getLe64(const uint8_t *p){
+    uint64_t v = 0;
+    for(int i = 7; i >= 0; --i)
+        v = v << 8 | p[i];
+    return v;
+}
+
+static void hashBlock(struct parcel_hash *h, const uint8_t *p){
+    uint64_t k1 = getLe64(p);
+    uint64_t k2 = getLe64(p + 8);
+
+    k1 *= HASH_C1; k1 = rotl64(k1, 31); k1 *= HASH_C2; h->h1 ^= k1;
+    h->h1 = rotl64(h->h1, 27); h->h1 += h->h2; h->h1 = h->h1 * 5 + 0x52dce729;
+    k2 *= HASH_C2; k2 = rotl64(k2, 33); k2 *= HASH_C1; h->h2 ^= k2;
+    h->h2 = rotl64(h->h2, 31); h->h2 += h->h1; h->h2 = h->h2 * 5 + 0x38495ab5;
+}
+
+void parcel_hash_init(struct parcel_hash *h){
+    memset(h, 0, sizeof(*h));
+}
+
+void parcel_hash_update(struct parcel_hash *h, const void *data, size_t len){
+    const uint8_t *p = (const uint8_t *)data;
+    h->len += len;
+
+    // Finish a block left over from the last update
+    if(h->ntail > 0){
+        size_t n = 16 - h->ntail < len ? 16 - h->ntail : len;
+        memcpy(h->tail + h->ntail, p, n);
+        h->ntail += n;
+        p += n;
+        len -= n;
+        if(h->ntail < 16)
+            return;
+        hashBlock(h, h->tail);
+        h->ntail = 0;
+    }
+    for(; len >= 16; p += 16, len -= 16)
+        hashBlock(h, p);
+    memcpy(h->tail, p, len);
+    h->ntail = len;
+}
+
+void parcel_hash_final(struct parcel_hash *h, uint8_t *out){
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    for(size_t i = h->ntail; i > 8; --i)
+        k2 = k2 << 8 | h->tail[i - 1];
+    for(size_t i = h->ntail < 8 ? h->ntail : 8; i > 0; --i)
+        k1 = k1 << 8 | h->tail[i - 1];
+    if(h->ntail > 8){
+        k2 *= HASH_C2; k2 = rotl64(k2, 33); k2 *= HASH_C1; h->h2 ^= k2;
+    }
+    if(h->ntail > 0){
+        k1 *= HASH_C1; k1 = rotl64(k1, 31); k1 *= HASH_C2; h->h1 ^= k1;
+    }
+
+    uint64_t h1 = h->h1 ^ h->len;
+    uint64_t h2 = h->h2 ^ h->len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    parcel_put64(out, h1);
+    parcel_put64(out + 8, h2);
+}
+
+// //////////////////////////////////////////////////////////////////////////
+
+int parcel_batch_init(struct parcel_node_batch *batch, size_t capacity){
+    batch->capacity = capacity;
+    batch->count = 0;
+    batch->uid = (uint8_t (*)[PARCEL_UID_SIZE])malloc(capacity * PARCEL_UID_SIZE);
+    batch->lnode = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    batch->rnode = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    batch->type = (uint8_t *)malloc(capacity);
+    batch->extra = (uint8_t *)malloc(capacity);
+    batch->offset = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    batch->size = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    if(!batch->uid || !batch->lnode || !batch->rnode || !batch->type || !batch->extra || !batch->offset || !batch->size){
+        parcel_batch_free(batch);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void parcel_batch_free(struct parcel_node_batch *batch){
+    free(batch->uid);
+    free(batch->lnode);
+    free(batch->rnode);
+    free(batch->type);
+    free(batch->extra);
+    free(batch->offset);
+    free(batch->size);
+    memset(batch, 0, sizeof(*batch));
+}
+
+size_t parcel_parse_treenodes(struct parcel_node_batch *batch, const uint8_t *data, size_t count){
+    if(count > batch->capacity)
+        count = batch->capacity;
+#ifdef PARCEL_SSSE3
+    static const bool ssse3 = __builtin_cpu_supports("ssse3");
+    if(ssse3){
+        batch->count = decodeSsse3(batch, data, count);
+        return batch->count;
+    }
+#endif
+    batch->count = decodeScalar(batch, data, count);
+    return batch->count;
+}
+
+uint64_t parcel_index_search(const uint8_t *block, const uint8_t *uid){
+    unsigned count = parcel_get16(block + 4);
+    const uint8_t *ent = block + PARCEL_INDEX_HEADER;
+
+    // Find the first entry greater than uid, the one before it covers uid
+    unsigned lo = 0;
+    unsigned hi = count;
+    while(lo < hi){
+        unsigned mid = (lo + hi) / 2;
+        if(memcmp(ent + mid * PARCEL_INDEX_ENTRY, uid, PARCEL_UID_SIZE) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo == 0)
+        return 0;
+
+    const uint8_t *e = ent + (lo - 1) * PARCEL_INDEX_ENTRY;
+    if(block[6] == 0 && memcmp(e, uid, PARCEL_UID_SIZE) != 0)
+        return 0;
+    return parcel_get64(e + PARCEL_UID_SIZE);
+}
+
+// //////////////////////////////////////////////////////////////////////////
+
+static struct parcel *openImage(const char *path, bool writable){
+    int fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if(fd == -1)
+        return NULL;
+
+    struct parcel *pc = new struct parcel;
+    pc->fd = fd;
+    pc->writable = writable;
+
+    uint8_t data[PARCEL_EXT_OFFSET + PARCEL_EXT_SIZE];
+    memset(data, 0, sizeof(data));
+    ssize_t n = pread(fd, data, sizeof(data), 0);
+    int err = EINVAL;
+    if(n >= PARCEL_SUPER_SIZE){
+        parcel_parse_super(&pc->sb, data);
+        if(pc->sb.magic == PARCEL_MAGIC){
+            err = 0;
+            if(pc->sb.version >= PARCEL_V2){
+                // The index is only used if it is intact
+                if(n < (ssize_t)sizeof(data) || pc->sb.extcrc != parcel_crc32(0, data + PARCEL_EXT_OFFSET, 60))
+                    err = EINVAL;
+                else if(readAt(fd, pc->root, PARCEL_BLOCK, pc->sb.indexroot) != 0 ||
+                        parcel_get32(pc->root) != PARCEL_INDEX_MAGIC)
+                    err = EIO;
+            }
+        }
+    }
+
+    if(err != 0){
+        close(fd);
+        delete pc;
+        errno = err;
+        return NULL;
+    }
+    return pc;
+}
+
+struct parcel *parcel_open(const char *path){
+    return openImage(path, false);
+}
+
+struct parcel *parcel_open_rw(const char *path){
+    return openImage(path, true);
+}
+
+void parcel_close(struct parcel *pc){
+    delete pc->ring;
+    if(pc->snapmap != NULL)
+        munmap(pc->snapmap, pc->snapmaplen);
+    close(pc->fd);
+    delete pc;
+}
+
+const struct parcel_super *parcel_super(const struct parcel *pc){
+    return &pc->sb;
+}
+
+int parcel_find(struct parcel *pc, const uint8_t *uid, struct parcel_node *node){
+    if(pc->sb.version >= PARCEL_V2)
+        return findIndexed(pc, uid, node);
+    if(pc->indexed)
+        return findSnapshot(pc, uid, node);
+    return findTree(pc, uid, node);
+}
+
+int parcel_load_index(struct parcel *pc, unsigned threads){
+    if(pc->sb.version >= PARCEL_V2 || pc->indexed)
+        return 1;
+    if(mapSnapshot(pc) == 0)
+        return 1;
+    if(threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    return rebuildIndex(pc, threads);
+}
+
+int parcel_save_index(struct parcel *pc){
+    if(pc->sb.version >= PARCEL_V2 || pc->snapmap != NULL)
+        return 0;
+    if(!pc->writable)
+        return -EROFS;
+    if(!pc->indexed)
+        return -EINVAL;
+
+    size_t size = pc->entrycount * PARCEL_INDEX_ENTRY;
+    uint8_t head[PARCEL_SNAPSHOT_HEADER];
+    memset(head, 0, sizeof(head));
+    parcel_put32(head, PARCEL_SNAPSHOT_MAGIC);
+    parcel_put32(head + 4, parcel_crc32(0, pc->entries, size));
+    parcel_put64(head + 8, parcel_tree_generation(&pc->sb));
+    parcel_put64(head + 16, pc->entrycount);
+    parcel_put32(head + 28, parcel_crc32(0, head, 28));
+
+    // The header goes after the entries and the flag last, so a torn write is never taken for a snapshot
+    if(writeAt(pc->fd, pc->entries, size, pc->sb.tail + sizeof(head)) != 0 ||
+       writeAt(pc->fd, head, sizeof(head), pc->sb.tail) != 0 ||
+       fdatasync(pc->fd) != 0)
+        return -EIO;
+    if(!(pc->sb.flags & PARCEL_FLAG_SNAPSHOT)){
+        pc->sb.flags |= PARCEL_FLAG_SNAPSHOT;
+        if(writeSuper(pc) != 0 || fdatasync(pc->fd) != 0)
+            return -EIO;
+    }
+    return 0;
+}
+
+ssize_t parcel_read(struct parcel *pc, const struct parcel_node *node, void *buf, size_t size, uint64_t off){
+    if(node->type < PARCEL_BLOB)
+        return -EINVAL;
+    if(off >= node->data.size)
+        return 0;
+    if(size > node->data.size - off)
+        size = node->data.size - off;
+    if(node->extra & PARCEL_EXTRA_INLINE){
+        if(node->data.size > PARCEL_INLINE_MAX)
+            return -EIO;
+        memcpy(buf, node->payload + off, size);
+        return size;
+    }
+    if(node->extra & PARCEL_EXTRA_COMPRESSED){
+        int ret = readCompressed(pc, node, (uint8_t *)buf, size, off);
+        return ret != 0 ? ret : (ssize_t)size;
+    }
+    if(pc->ring != NULL && readCached(pc, node, (uint8_t *)buf, size, off))
+        return size;
+    if(readAt(pc->fd, buf, size, node->data.offset + off) != 0)
+        return -EIO;
+    return size;
+}
+
+int parcel_start_async(struct parcel *pc, unsigned depth, unsigned buffers, size_t bufsize){
+    if(pc->ring != NULL)
+        return -EBUSY;
+    pc->ring = ParcelRing::create(pc->fd, depth, buffers, bufsize);
+    return pc->ring != NULL ? 0 : -errno;
+}
+
+void parcel_stop_async(struct parcel *pc){
+    delete pc->ring;
+    pc->ring = NULL;
+}
+
+void parcel_read_async(struct parcel *pc, const struct parcel_node *node, size_t size, uint64_t off,
+                       parcel_read_done done, void *arg){
+    bool plain = node->type >= PARCEL_BLOB && !(node->extra & (PARCEL_EXTRA_INLINE | PARCEL_EXTRA_COMPRESSED));
+    if(plain && off < node->data.size && pc->ring != NULL){
+        if(size > node->data.size - off)
+            size = node->data.size - off;
+
+        // Read ahead data is copied from the cache right away
+        ChunkKey key = { node->data.offset, off / PARCEL_CHUNK };
+        if(!pc->cache.get(key) && pc->ring->read(node->data.offset + off, size, done, arg))
+            return;
+    }
+
+    std::vector<uint8_t> buf(size);
+    ssize_t n = parcel_read(pc, node, buf.data(), size, off);
+    done(arg, buf.data(), n);
+}
+
+void parcel_readahead(struct parcel *pc, const struct parcel_node *node, uint64_t off, size_t size){
+    if(pc->ring == NULL || node->type < PARCEL_BLOB || (node->extra & PARCEL_EXTRA_INLINE) || off >= node->data.size)
+        return;
+    if(size > node->data.size - off)
+        size = node->data.size - off;
+    if(size == 0)
+        return;
+
+    // Runs of chunks that are neither cached nor on their way are read with one request each
+    uint64_t last = (off + size - 1) / PARCEL_CHUNK;
+    uint64_t first = 0;
+    uint64_t count = 0;
+    for(uint64_t c = off / PARCEL_CHUNK; c <= last + 1; ++c){
+        ChunkKey key = { node->data.offset, c };
+        bool fetch = false;
+        if(c <= last && !pc->cache.get(key)){
+            std::lock_guard<std::mutex> lock(pc->pendingLock);
+            fetch = pc->pending.insert(key).second;
+        }
+        if(fetch && count < READAHEAD_RUN){
+            if(count++ == 0)
+                first = c;
+            continue;
+        }
+        if(count > 0)
+            readaheadRun(pc, node, first, count);
+        count = 0;
+        if(fetch){
+            first = c;
+            count = 1;
+        }
+    }
+}
+
+int parcel_node_name(struct parcel *pc, const struct parcel_node *node, char *name, uint64_t *skip){
+    *skip = 0;
+    if(node->type == PARCEL_FILE){
+        uint8_t len[2];
+        if(parcel_read(pc, node, len, 2, 0) != 2)
+            return -EIO;
+        size_t n = parcel_get16(len);
+        if(node->data.size < 2 + n)
+            return -EIO;
+        *skip = 2 + n;
+
+        // Names that can not be a directory entry fall back to the uid
+        if(n > 0 && n <= PARCEL_NAME_MAX){
+            if(parcel_read(pc, node, name, n, 2) != (ssize_t)n)
+                return -EIO;
+            name[n] = '\0';
+            if(strlen(name) == n && !strchr(name, '/') && strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+                return 0;
+        }
+    }
+    for(int i = 0; i < PARCEL_UID_SIZE; ++i)
+        sprintf(name + i * 2, "%02x", node->uid[i]);
+    return 0;
+}
+
+void parcel_nameindex_uid(const uint8_t *listuid, uint8_t *uid){
+    static const char tag[] = "parcel name index";
+    struct parcel_hash h;
+    parcel_hash_init(&h);
+    parcel_hash_update(&h, tag, sizeof(tag));
+    parcel_hash_update(&h, listuid, PARCEL_UID_SIZE);
+    parcel_hash_final(&h, uid);
+}
+
+int parcel_dir_lookup(struct parcel *pc, const struct parcel_node *dir, const char *name, struct parcel_node *node){
+    if(dir->type != PARCEL_LIST || !(dir->extra & PARCEL_EXTRA_NAMEINDEX))
+        return -EINVAL;
+    std::shared_ptr<const NameIndex> ni;
+    int ret = loadNameIndex(pc, dir, ni);
+    if(ret != 0)
+        return ret;
+
+    size_t len = strlen(name);
+    if(len == 0 || len > PARCEL_NAME_MAX || ni->count == 0)
+        return -ENOENT;
+
+    // Most missing names stop here, without reading anything
+    uint8_t hash[PARCEL_HASH_SIZE];
+    struct parcel_hash h;
+    parcel_hash_init(&h);
+    parcel_hash_update(&h, name, len);
+    parcel_hash_final(&h, hash);
+    const uint8_t *bloom = ni->head.data() + PARCEL_NAMEINDEX_HEADER;
+    for(unsigned i = 0; i < ni->hashes; ++i){
+        uint64_t bit = parcel_bloom_bit(hash, i, (uint64_t)ni->bloombytes * 8);
+        if(!(bloom[bit / 8] & 1 << bit % 8))
+            return -ENOENT;
+    }
+
+    // Last restart whose name is not greater than name
+    const uint64_t entries = ni->head.size();
+    const uint64_t total = ni->node.data.size - entries;
+    uint8_t buf[2 + PARCEL_NAME_MAX + PARCEL_UID_SIZE];
+    uint32_t lo = 0;
+    uint32_t hi = ni->restarts;
+    while(hi - lo > 1){
+        uint32_t mid = lo + (hi - lo) / 2;
+        ssize_t n = parcel_read(pc, &ni->node, buf, sizeof(buf), entries + ni->restart(mid));
+        if(n < 2 || buf[0] != 0 || n < 2 + buf[1])
+            return -EIO;
+        if(compareName(name, len, buf + 2, buf[1]) < 0)
+            hi = mid;
+        else
+            lo = mid;
+    }
+
+    // Scan the block from that restart to the next
+    uint64_t start = ni->restart(lo);
+    uint64_t end = lo + 1 < ni->restarts ? ni->restart(lo + 1) : total;
+    if(start > end || end > total)
+        return -EIO;
+    std::vector<uint8_t> block(end - start);
+    if(parcel_read(pc, &ni->node, block.data(), block.size(), entries + start) != (ssize_t)block.size())
+        return -EIO;
+
+    uint8_t key[PARCEL_NAME_MAX];
+    size_t keylen = 0;
+    for(size_t pos = 0; pos < block.size(); ){
+        if(block.size() - pos < 2)
+            return -EIO;
+        size_t shared = block[pos];
+        size_t suffix = block[pos + 1];
+        if(shared > keylen || shared + suffix > PARCEL_NAME_MAX || block.size() - pos < 2 + suffix + PARCEL_UID_SIZE)
+            return -EIO;
+        memcpy(key + shared, &block[pos + 2], suffix);
+        keylen = shared + suffix;
+        pos += 2 + suffix;
+
+        int cmp = compareName(name, len, key, keylen);
+        if(cmp == 0)
+            return parcel_find(pc, &block[pos], node);
+        if(cmp < 0)
+            break;
+        pos += PARCEL_UID_SIZE;
+    }
+    return -ENOENT;
+}
+
+void parcel_set_cache(struct parcel *pc, size_t bytes){
+    pc->cache.resize(bytes);
+}
+
+int parcel_node_at(struct parcel *pc, uint64_t offset, struct parcel_node *node){
+    return readNode(pc, offset, node);
+}
+
+int parcel_walk(struct parcel *pc, int (*fn)(const struct parcel_node *node, void *arg), void *arg){
+    if(pc->sb.version >= PARCEL_V2)
+        return walkRun(pc, fn, arg);
+    return walkTree(pc, fn, arg);
+}
+
+int parcel_scan(struct parcel *pc, int (*fn)(const struct parcel_node_batch *batch, uint64_t first, void *arg), void *arg){
+    if(pc->sb.version >= PARCEL_V2)
+        return scanRun(pc, fn, arg);
+
+    ScanTree st;
+    if(parcel_batch_init(&st.batch, 4096) != 0)
+        return -ENOMEM;
+    st.first = 0;
+    st.fn = fn;
+    st.arg = arg;
+    int ret = walkTree(pc, scanTreeNode, &st);
+    if(ret == 0 && st.batch.count > 0)
+        ret = fn(&st.batch, st.first, arg);
+    parcel_batch_free(&st.batch);
+    return ret;
+}
+
+int parcel_extent_find(struct parcel *pc, const uint8_t *hash, struct parcel_extent *ext){
+    uint64_t pos;
+    int ret = findExtent(pc, hash, ext, &pos);
+    if(ret == 0 && ext->refs == 0)
+        return -ENOENT;
+    return ret;
+}
+
+int parcel_extent_ref(struct parcel *pc, const uint8_t *hash, struct parcel_extent *ext){
+    if(!pc->writable)
+        return -EBADF;
+    uint64_t pos;
+    int ret = findExtent(pc, hash, ext, &pos);
+    if(ret != 0)
+        return ret;
+    if(ext->refs == 0)
+        return -ENOENT;
+
+    uint8_t data[PARCEL_EXTENT_ENTRY];
+    ++ext->refs;
+    parcel_encode_extent(ext, data);
+    return writeAt(pc->fd, data, sizeof(data), pos);
+}
+
+int parcel_extent_unref(struct parcel *pc, const uint8_t *hash){
+    if(!pc->writable)
+        return -EBADF;
+    struct parcel_extent ext;
+    uint64_t pos;
+    int ret = findExtent(pc, hash, &ext, &pos);
+    if(ret != 0)
+        return ret;
+    if(ext.refs == 0)
+        return -ENOENT;
+
+    uint8_t data[PARCEL_EXTENT_ENTRY];
+    --ext.refs;
+    parcel_encode_extent(&ext, data);
+    if(writeAt(pc->fd, data, sizeof(data), pos) != 0)
+        return -EIO;
+    if(ext.refs == 0 && (ret = freeExtent(pc, &ext)) != 0)
+        return ret;
+    return ext.refs;
+}
@@ -0,0 +1,122 @@
+#ifndef PARCELADAPTER_H
+#define PARCELADAPTER_H
+
+/* Read access to a Parcel image for TreeFS. Lookups use the v2 uid index when the image has
+ * one, and fall back to walking the v1 lnode/rnode tree otherwise.
+ */
+
+#include "parcelformat.h"
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct parcel;
+
+//! Open an image read only. Returns NULL and sets errno on failure.
+struct parcel *parcel_open(const char *path);
+//! Open an image for writing, only needed for the extent reference calls.
+struct parcel *parcel_open_rw(const char *path);
+void parcel_close(struct parcel *pc);
+
+const struct parcel_super *parcel_super(const struct parcel *pc);
+
+//! Find the tree node for uid. Returns 0, -ENOENT or -EIO.
+int parcel_find(struct parcel *pc, const uint8_t *uid, struct parcel_node *node);
+
+/* Give a v1 image an in-memory uid index, so finds do not walk the tree. A current index
+ * snapshot is mapped, otherwise the tree is walked by threads workers, 0 for one per CPU.
+ * Returns 1 if the index was mapped or the image is v2 and has one on disk, 0 if it was
+ * rebuilt, or a negative errno and finds keep walking the tree.
+ */
+int parcel_load_index(struct parcel *pc, unsigned threads);
+
+/* Save a rebuilt index as the snapshot of an image opened for writing, for a clean unmount.
+ * Returns 0, also if the snapshot is current already or the image is v2, -EROFS, -EINVAL if
+ * there is no index, or -EIO.
+ */
+int parcel_save_index(struct parcel *pc);
+
+//! Read the tree node stored at offset. Returns 0 or -EIO.
+int parcel_node_at(struct parcel *pc, uint64_t offset, struct parcel_node *node);
+
+/* Read payload data of a node, decompressing compressed extents. Returns bytes read or a
+ * negative errno. Safe to call from several threads.
+ */
+ssize_t parcel_read(struct parcel *pc, const struct parcel_node *node, void *buf, size_t size, uint64_t off);
+
+//! Completion of parcel_read_async(), data is only valid during the call.
+typedef void (*parcel_read_done)(void *arg, const void *data, ssize_t result);
+
+/* Queue plain payload reads on an io_uring of depth entries. Up to buffers reads of at most
+ * bufsize bytes each at a time go into buffers registered with the kernel. Returns 0, or a
+ * negative errno and reads stay synchronous.
+ */
+int parcel_start_async(struct parcel *pc, unsigned depth, unsigned buffers, size_t bufsize);
+
+//! Wait for queued reads and go back to synchronous reads.
+void parcel_stop_async(struct parcel *pc);
+
+/* Read like parcel_read() and pass the result to done. Reads of plain extents go through the
+ * ring from parcel_start_async() and complete on its thread. Inline and compressed data, and
+ * reads while the ring is full, are read synchronously and done is called before returning.
+ */
+void parcel_read_async(struct parcel *pc, const struct parcel_node *node, size_t size, uint64_t off,
+                       parcel_read_done done, void *arg);
+
+/* Start reading the chunks covering a range of payload data into the chunk cache, on the
+ * ring from parcel_start_async(), without waiting for them. Later reads of the range, plain or
+ * compressed, are then copied from memory. Chunks already cached or on their way are skipped,
+ * and without a ring this does nothing.
+ */
+void parcel_readahead(struct parcel *pc, const struct parcel_node *node, uint64_t off, size_t size);
+
+/* Directory entry name of a node, into a buffer of PARCEL_NAME_MAX + 1. File objects are named
+ * by their embedded name, everything else by its uid in hex. For file objects skip is set to
+ * the length of the name header before the content, else to 0. Returns 0 or -EIO.
+ */
+int parcel_node_name(struct parcel *pc, const struct parcel_node *node, char *name, uint64_t *skip);
+
+/* Look up name in a list with a name index. Returns 0, -ENOENT, -EIO, or -EINVAL if dir has
+ * no name index. Negative lookups are mostly answered by the Bloom filter, and index heads
+ * are cached, so they usually cost no reads.
+ */
+int parcel_dir_lookup(struct parcel *pc, const struct parcel_node *dir, const char *name, struct parcel_node *node);
+
+/* Bytes of decompressed and read ahead chunks kept in memory, 0 disables the cache. The
+ * default is 16 MiB.
+ */
+void parcel_set_cache(struct parcel *pc, size_t bytes);
+
+/* Call fn for every tree node in uid order, stops early if fn returns nonzero.
+ * Returns 0, the nonzero value from fn, or a negative errno.
+ */
+int parcel_walk(struct parcel *pc, int (*fn)(const struct parcel_node *node, void *arg), void *arg);
+
+/* Call fn for batches of tree nodes in uid order, first is the position of the first node in
+ * the batch. On v2 images the node run is read and decoded in bulk. Same returns as walk.
+ */
+int parcel_scan(struct parcel *pc, int (*fn)(const struct parcel_node_batch *batch, uint64_t first, void *arg), void *arg);
+
+/* Find the extent holding content with hash. Returns 0, -ENOENT, or -EIO. Extents that
+ * were freed are not found.
+ */
+int parcel_extent_find(struct parcel *pc, const uint8_t *hash, struct parcel_extent *ext);
+
+/* Dedup on write: a writer hashes a new payload and, if the content is already stored, points
+ * its node at the returned extent instead of writing the payload again. Same returns as find.
+ */
+int parcel_extent_ref(struct parcel *pc, const uint8_t *hash, struct parcel_extent *ext);
+
+/* Drop one reference to the extent with hash. When none remain the extent goes on the end of
+ * the free list. Returns the references left, or a negative errno.
+ */
+int parcel_extent_unref(struct parcel *pc, const uint8_t *hash);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PARCELADAPTER_H
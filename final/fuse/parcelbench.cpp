@@ -0,0 +1,90 @@
+/* Benchmark of tree node decoding, one node at a time with parcel_parse_treenode() versus
+ * batches with parcel_parse_treenodes(). Nodes are encoded in memory, so only decoding is
+ * measured.
+ *
+ * usage: parcelbench [nodes] [rounds]
+ */
+
+#include "parceladapter.h"
+
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double monoSecs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv){
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 0) : 1 << 20;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    if(count == 0 || rounds <= 0){
+        fprintf(stderr, "usage: %s [nodes] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    // Random nodes of every type
+    std::vector<uint8_t> image(count * PARCEL_NODE_SIZE);
+    srand(1);
+    for(size_t i = 0; i < count; ++i){
+        struct parcel_node node;
+        memset(&node, 0, sizeof(node));
+        node.magic = PARCEL_TREE_MAGIC;
+        for(int k = 0; k < PARCEL_UID_SIZE; ++k)
+            node.uid[k] = rand();
+        node.lnode = (uint64_t)rand() << 20;
+        node.rnode = (uint64_t)rand() << 20;
+        node.type = 1 + i % PARCEL_FILE;
+        node.data.offset = (uint64_t)rand() << 12;
+        node.data.size = rand();
+        for(int k = 0; k < 16; ++k)
+            node.payload[k] = rand();
+        parcel_encode_treenode(&node, image.data() + i * PARCEL_NODE_SIZE);
+    }
+
+    // Scans decode in chunks, so each decoder fills a cache sized chunk at a time
+    const size_t chunk = 4096;
+    std::vector<struct parcel_node> nodes(chunk);
+    struct parcel_node_batch batch;
+    if(parcel_batch_init(&batch, chunk) != 0){
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    uint64_t check[2] = { 0, 0 };
+    double best[2] = { 1e9, 1e9 };
+    for(int r = 0; r < rounds; ++r){
+        double start = monoSecs();
+        for(size_t i = 0; i < count; i += chunk){
+            size_t n = count - i < chunk ? count - i : chunk;
+            for(size_t k = 0; k < n; ++k)
+                parcel_parse_treenode(&nodes[k], image.data() + (i + k) * PARCEL_NODE_SIZE);
+            check[0] += nodes[n - 1].lnode + nodes[n - 1].data.size;
+        }
+        double secs = monoSecs() - start;
+        if(secs < best[0])
+            best[0] = secs;
+
+        start = monoSecs();
+        for(size_t i = 0; i < count; i += chunk){
+            size_t n = parcel_parse_treenodes(&batch, image.data() + i * PARCEL_NODE_SIZE, count - i < chunk ? count - i : chunk);
+            check[1] += batch.lnode[n - 1] + batch.size[n - 1];
+        }
+        secs = monoSecs() - start;
+        if(secs < best[1])
+            best[1] = secs;
+    }
+    parcel_batch_free(&batch);
+
+    if(check[0] != check[1]){
+        fprintf(stderr, "decoders disagree\n");
+        return 1;
+    }
+    printf("scalar: %zu nodes in %.6f sec, %.1f M nodes/sec\n", count, best[0], count / best[0] / 1e6);
+    printf("batch: %zu nodes in %.6f sec, %.1f M nodes/sec\n", count, best[1], count / best[1] / 1e6);
+    return 0;
+}
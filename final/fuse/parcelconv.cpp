@@ -0,0 +1,551 @@
+/* Parcel image converter. Rewrites an image as v2: tree nodes are stored contiguously in uid
+ * order behind a static B+tree uid index in 4 KiB blocks, the lnode/rnode tree is rebuilt
+ * balanced for v1 readers, and payload data is compacted, which drops the free list.
+ * Payloads are stored once per distinct content, see the extent table in parcelformat.h.
+ * With -c, blob, string and file payloads of a block or more are LZ4 compressed in chunks.
+ * Data of up to 16 bytes is stored inline in its node instead of in an extent. Lists of 16
+ * or more members get a name index object with a Bloom filter, for directory lookups.
+ *
+ * usage: parcelconv [-c] <input> <output>
+ */
+
+#include "parceladapter.h"
+
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Sequential output through a large buffer
+class Writer {
+public:
+    Writer(int fd) : _fd(fd), _off(0), _failed(false){
+        _buf.reserve(BUFFER);
+    }
+
+    void write(const void *data, size_t size){
+        const uint8_t *p = (const uint8_t *)data;
+        _buf.insert(_buf.end(), p, p + size);
+        if(_buf.size() >= BUFFER)
+            flush();
+    }
+
+    void flush(){
+        const uint8_t *p = _buf.data();
+        size_t size = _buf.size();
+        while(size > 0 && !_failed){
+            ssize_t n = pwrite(_fd, p, size, _off);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0){
+                _failed = true;
+                break;
+            }
+            p += n;
+            size -= n;
+            _off += n;
+        }
+        _buf.clear();
+    }
+
+    uint64_t offset() const { return _off + _buf.size(); }
+    bool failed() const { return _failed; }
+
+private:
+    static const size_t BUFFER = 1 << 20;
+
+    int _fd;
+    uint64_t _off;
+    bool _failed;
+    std::vector<uint8_t> _buf;
+};
+
+/* A unique payload, and a node of the input image to copy its content from, or the content
+ * of objects made here. Compressed extents keep their chunk table, ext.size is the size
+ * stored in the output.
+ */
+struct Extent {
+    struct parcel_extent ext;
+    struct parcel_node src;
+    const std::vector<uint8_t> *content;
+    bool compressed;
+    std::vector<uint32_t> ends;
+};
+
+typedef std::pair<std::string, std::array<uint8_t, PARCEL_UID_SIZE>> NameEntry;
+
+static const size_t NO_EXTENT = (size_t)-1;
+static const uint64_t COMPRESS_MIN = PARCEL_BLOCK;
+static const uint64_t NAMEINDEX_MIN = 16;       // list members
+static const unsigned BLOOM_BITS = 10;          // per name, about 1% false positives
+static const unsigned BLOOM_HASHES = 7;
+static const unsigned RESTART_INTERVAL = 16;
+
+static int collect(const struct parcel_node *node, void *arg){
+    ((std::vector<struct parcel_node> *)arg)->push_back(*node);
+    return 0;
+}
+
+static bool uidLess(const struct parcel_node &a, const struct parcel_node &b){
+    return memcmp(a.uid, b.uid, PARCEL_UID_SIZE) < 0;
+}
+
+static bool uidEqual(const struct parcel_node &a, const struct parcel_node &b){
+    return memcmp(a.uid, b.uid, PARCEL_UID_SIZE) == 0;
+}
+
+static bool hashLess(const struct parcel_extent &a, const struct parcel_extent &b){
+    return memcmp(a.hash, b.hash, PARCEL_HASH_SIZE) < 0;
+}
+
+static bool nameLess(const NameEntry &a, const NameEntry &b){
+    return a.first < b.first;
+}
+
+static bool nameEqual(const NameEntry &a, const NameEntry &b){
+    return a.first == b.first;
+}
+
+// Returns 0 or an errno
+static int hashPayload(struct parcel *in, const struct parcel_node *node, std::vector<uint8_t> &buf, uint8_t *hash){
+    struct parcel_hash h;
+    parcel_hash_init(&h);
+    for(uint64_t pos = 0; pos < node->data.size; ){
+        ssize_t len = parcel_read(in, node, buf.data(), buf.size(), pos);
+        if(len <= 0)
+            return len < 0 ? -len : EIO;
+        parcel_hash_update(&h, buf.data(), len);
+        pos += len;
+    }
+    parcel_hash_final(&h, hash);
+    return 0;
+}
+
+static bool compressible(const struct parcel_node &node){
+    return (node.type == PARCEL_BLOB || node.type == PARCEL_STRING || node.type == PARCEL_FILE) &&
+           node.data.size >= COMPRESS_MIN && node.data.size <= UINT32_MAX;
+}
+
+/* Compress a payload chunk by chunk. Without out, only the chunk table is computed. With out,
+ * the table and the chunks are written, compressing again instead of holding the output of
+ * the first pass, and the chunks must come out as the table says. Returns 0 or an errno.
+ */
+static int packExtent(struct parcel *in, const struct parcel_node *src, std::vector<uint32_t> &ends, Writer *out){
+    uint8_t raw[PARCEL_CHUNK];
+    uint8_t packed[PARCEL_CHUNK];
+    uint8_t data[4];
+    if(out){
+        for(uint32_t end : ends){
+            parcel_put32(data, end);
+            out->write(data, sizeof(data));
+        }
+    } else {
+        ends.clear();
+    }
+
+    uint32_t end = 0;
+    for(uint64_t pos = 0, c = 0; pos < src->data.size; pos += PARCEL_CHUNK, ++c){
+        ssize_t len = parcel_read(in, src, raw, sizeof(raw), pos);
+        if(len <= 0)
+            return len < 0 ? -len : EIO;
+        // A chunk is only stored compressed if that makes it smaller
+        size_t n = parcel_lz4_compress(raw, len, packed, len - 1);
+        end += n > 0 ? n : len;
+        if(!out){
+            ends.push_back(end);
+            continue;
+        }
+        if(ends[c] != end)
+            return EIO;
+        out->write(n > 0 ? packed : raw, n > 0 ? n : len);
+    }
+    return 0;
+}
+
+/* Encode the name index of a list, see parcelformat.h. Members missing from the image are
+ * left out, and of equal names the first in list order wins, like a directory scan.
+ * Returns 0 or an errno.
+ */
+static int buildNameIndex(struct parcel *in, const struct parcel_node &list, std::vector<uint8_t> &out){
+    std::vector<uint8_t> uids(list.data.size - list.data.size % PARCEL_UID_SIZE);
+    if(parcel_read(in, &list, uids.data(), uids.size(), 0) != (ssize_t)uids.size())
+        return EIO;
+
+    std::vector<NameEntry> entries;
+    char name[PARCEL_NAME_MAX + 1];
+    for(size_t i = 0; i < uids.size(); i += PARCEL_UID_SIZE){
+        struct parcel_node member;
+        uint64_t skip;
+        int ret = parcel_find(in, &uids[i], &member);
+        if(ret == -ENOENT)
+            continue;
+        if(ret != 0 || parcel_node_name(in, &member, name, &skip) != 0)
+            return EIO;
+        entries.emplace_back();
+        entries.back().first = name;
+        memcpy(entries.back().second.data(), &uids[i], PARCEL_UID_SIZE);
+    }
+    std::stable_sort(entries.begin(), entries.end(), nameLess);
+    entries.erase(std::unique(entries.begin(), entries.end(), nameEqual), entries.end());
+
+    uint32_t count = entries.size();
+    uint32_t bloombytes = (count * BLOOM_BITS + 7) / 8 < 8 ? 8 : (count * BLOOM_BITS + 7) / 8;
+    uint32_t restarts = (count + RESTART_INTERVAL - 1) / RESTART_INTERVAL;
+    out.assign(PARCEL_NAMEINDEX_HEADER + bloombytes + restarts * 4, 0);
+    parcel_put32(&out[0], PARCEL_NAMEINDEX_MAGIC);
+    parcel_put32(&out[4], count);
+    parcel_put32(&out[8], bloombytes);
+    out[12] = BLOOM_HASHES;
+    out[13] = RESTART_INTERVAL;
+
+    // Positions, out grows as entries are added
+    size_t bloom = PARCEL_NAMEINDEX_HEADER;
+    size_t base = out.size();
+    const std::string *prev = NULL;
+    for(uint32_t i = 0; i < count; ++i){
+        const std::string &key = entries[i].first;
+        uint8_t hash[PARCEL_HASH_SIZE];
+        struct parcel_hash h;
+        parcel_hash_init(&h);
+        parcel_hash_update(&h, key.data(), key.size());
+        parcel_hash_final(&h, hash);
+        for(unsigned k = 0; k < BLOOM_HASHES; ++k){
+            uint64_t bit = parcel_bloom_bit(hash, k, (uint64_t)bloombytes * 8);
+            out[bloom + bit / 8] |= 1 << bit % 8;
+        }
+
+        size_t shared = 0;
+        if(i % RESTART_INTERVAL == 0){
+            parcel_put32(&out[bloom + bloombytes + i / RESTART_INTERVAL * 4], out.size() - base);
+        } else {
+            while(shared < key.size() && shared < prev->size() && key[shared] == (*prev)[shared])
+                ++shared;
+        }
+        out.push_back(shared);
+        out.push_back(key.size() - shared);
+        out.insert(out.end(), key.begin() + shared, key.end());
+        out.insert(out.end(), entries[i].second.begin(), entries[i].second.end());
+        prev = &key;
+    }
+    return 0;
+}
+
+// Link nodes [lo, hi) into a balanced tree, returns the offset of its root
+static uint64_t linkTree(std::vector<struct parcel_node> &nodes, size_t lo, size_t hi){
+    if(lo >= hi)
+        return 0;
+    size_t mid = lo + (hi - lo) / 2;
+    nodes[mid].lnode = linkTree(nodes, lo, mid);
+    nodes[mid].rnode = linkTree(nodes, mid + 1, hi);
+    return nodes[mid].offset;
+}
+
+/* Write the uid index, top level first. An entry in a leaf maps a uid to its tree node, an
+ * entry in an internal block maps the first uid under a child block to that block.
+ */
+static void writeIndex(Writer &out, const std::vector<struct parcel_node> &nodes,
+                       const std::vector<uint64_t> &levelblocks, const std::vector<uint64_t> &levelstart){
+    const uint64_t fanout = PARCEL_INDEX_FANOUT;
+    uint8_t block[PARCEL_BLOCK];
+
+    for(int level = levelblocks.size() - 1; level >= 0; --level){
+        // Number of nodes under one entry at this level
+        uint64_t span = 1;
+        for(int l = 0; l < level; ++l)
+            span *= fanout;
+        uint64_t entries = level == 0 ? nodes.size() : levelblocks[level - 1];
+
+        for(uint64_t b = 0; b < levelblocks[level]; ++b){
+            memset(block, 0, sizeof(block));
+            uint64_t first = b * fanout;
+            uint64_t count = entries - first < fanout ? entries - first : fanout;
+
+            uint8_t *ent = block + PARCEL_INDEX_HEADER;
+            for(uint64_t e = 0; e < count; ++e, ent += PARCEL_INDEX_ENTRY){
+                const struct parcel_node &node = nodes[(first + e) * span];
+                memcpy(ent, node.uid, PARCEL_UID_SIZE);
+                if(level == 0)
+                    parcel_put64(ent + PARCEL_UID_SIZE, node.offset);
+                else
+                    parcel_put64(ent + PARCEL_UID_SIZE, levelstart[level - 1] + (first + e) * PARCEL_BLOCK);
+            }
+
+            parcel_put32(block, PARCEL_INDEX_MAGIC);
+            parcel_put16(block + 4, count);
+            block[6] = level;
+            parcel_put32(block + 8, parcel_crc32(0, block + PARCEL_INDEX_HEADER, count * PARCEL_INDEX_ENTRY));
+            out.write(block, sizeof(block));
+        }
+    }
+}
+
+int main(int argc, char **argv){
+    bool compress = argc == 4 && strcmp(argv[1], "-c") == 0;
+    if(argc != 3 && !compress){
+        fprintf(stderr, "usage: %s [-c] <input> <output>\n", argv[0]);
+        return 1;
+    }
+    const char *inpath = argv[argc - 2];
+    const char *outpath = argv[argc - 1];
+
+    struct parcel *in = parcel_open(inpath);
+    if(in == NULL){
+        fprintf(stderr, "%s: %s\n", inpath, strerror(errno));
+        return 1;
+    }
+
+    std::vector<struct parcel_node> nodes;
+    int ret = parcel_walk(in, collect, &nodes);
+    if(ret != 0){
+        fprintf(stderr, "%s: %s\n", inpath, strerror(-ret));
+        parcel_close(in);
+        return 1;
+    }
+    std::sort(nodes.begin(), nodes.end(), uidLess);
+    nodes.erase(std::unique(nodes.begin(), nodes.end(), uidEqual), nodes.end());
+
+    // Name indexes are rebuilt from the lists
+    nodes.erase(std::remove_if(nodes.begin(), nodes.end(), [](const struct parcel_node &node){
+        return node.type == PARCEL_NAMEINDEX;
+    }), nodes.end());
+    std::unordered_map<std::string, std::vector<uint8_t>> generated;
+    std::vector<struct parcel_node> made;
+    for(struct parcel_node &list : nodes){
+        list.extra &= ~PARCEL_EXTRA_NAMEINDEX;
+        if(list.type != PARCEL_LIST || list.data.size / PARCEL_UID_SIZE < NAMEINDEX_MIN)
+            continue;
+        struct parcel_node node;
+        memset(&node, 0, sizeof(node));
+        node.type = PARCEL_NAMEINDEX;
+        parcel_nameindex_uid(list.uid, node.uid);
+        std::vector<uint8_t> &content = generated[std::string((const char *)node.uid, PARCEL_UID_SIZE)];
+        if((ret = buildNameIndex(in, list, content)) != 0)
+            break;
+        node.data.size = content.size();
+        made.push_back(node);
+        list.extra |= PARCEL_EXTRA_NAMEINDEX;
+    }
+    if(ret != 0){
+        fprintf(stderr, "%s: %s\n", inpath, strerror(ret));
+        parcel_close(in);
+        return 1;
+    }
+    nodes.insert(nodes.end(), made.begin(), made.end());
+    std::sort(nodes.begin(), nodes.end(), uidLess);
+    uint64_t n = nodes.size();
+
+    // Index shape, leaves first. An empty image still gets an empty root.
+    const uint64_t fanout = PARCEL_INDEX_FANOUT;
+    std::vector<uint64_t> levelblocks;
+    uint64_t blocks = n > 0 ? (n + fanout - 1) / fanout : 1;
+    levelblocks.push_back(blocks);
+    while(blocks > 1){
+        blocks = (blocks + fanout - 1) / fanout;
+        levelblocks.push_back(blocks);
+    }
+    int depth = levelblocks.size();
+
+    // Layout: superblock block, index top level first, nodes, data
+    std::vector<uint64_t> levelstart(depth);
+    uint64_t off = PARCEL_BLOCK;
+    for(int level = depth - 1; level >= 0; --level){
+        levelstart[level] = off;
+        off += levelblocks[level] * PARCEL_BLOCK;
+    }
+    uint64_t nodestart = off;
+    off += n * PARCEL_NODE_SIZE;
+
+    /* Content hash of every payload, nodes with identical payloads share one extent. The
+     * storage bits of extra are set again for the output, src keeps them for reading.
+     */
+    std::vector<uint8_t> buf(1 << 20);
+    std::vector<Extent> extents;
+    std::unordered_map<std::string, size_t> byhash;
+    std::vector<size_t> nodeextent(n, NO_EXTENT);
+    uint64_t inlined = 0;
+    for(uint64_t i = 0; i < n && ret == 0; ++i){
+        struct parcel_node src = nodes[i];
+        nodes[i].extra &= ((1 << PARCEL_INLINE_SHIFT) - 1) & ~(PARCEL_EXTRA_COMPRESSED | PARCEL_EXTRA_INLINE);
+        if(src.type < PARCEL_BLOB || src.data.size == 0)
+            continue;
+
+        if(src.data.size <= PARCEL_INLINE_MAX){
+            uint8_t data[PARCEL_INLINE_MAX];
+            ssize_t len = parcel_read(in, &src, data, sizeof(data), 0);
+            if(len != (ssize_t)src.data.size){
+                ret = len < 0 ? -len : EIO;
+                break;
+            }
+            memset(nodes[i].payload, 0, sizeof(nodes[i].payload));
+            memcpy(nodes[i].payload, data, len);
+            nodes[i].extra = parcel_inline_extra(nodes[i].extra, len);
+            ++inlined;
+            continue;
+        }
+
+        Extent e;
+        memset(&e.ext, 0, sizeof(e.ext));
+        e.content = NULL;
+        e.compressed = false;
+        if(src.type == PARCEL_NAMEINDEX){
+            struct parcel_hash h;
+            e.content = &generated[std::string((const char *)src.uid, PARCEL_UID_SIZE)];
+            parcel_hash_init(&h);
+            parcel_hash_update(&h, e.content->data(), e.content->size());
+            parcel_hash_final(&h, e.ext.hash);
+        } else {
+            ret = hashPayload(in, &src, buf, e.ext.hash);
+        }
+        e.ext.size = src.data.size;
+        e.src = src;
+
+        // Sizes are part of the key, so equal hashes of different lengths never merge
+        std::string key((const char *)e.ext.hash, PARCEL_HASH_SIZE);
+        key.append((const char *)&e.ext.size, sizeof(e.ext.size));
+        auto it = byhash.find(key);
+        if(it == byhash.end()){
+            it = byhash.emplace(key, extents.size()).first;
+            extents.push_back(e);
+        }
+        nodeextent[i] = it->second;
+        ++extents[it->second].ext.refs;
+    }
+
+    // Chunk tables of the extents to compress, kept raw if compression does not pay
+    uint64_t rawsize = 0;
+    for(size_t k = 0; k < extents.size() && ret == 0; ++k){
+        Extent &e = extents[k];
+        rawsize += e.ext.size;
+        if(!compress || !compressible(e.src))
+            continue;
+        ret = packExtent(in, &e.src, e.ends, NULL);
+        uint64_t stored = e.ends.size() * 4 + (e.ends.empty() ? 0 : e.ends.back());
+        if(ret == 0 && stored < e.ext.size){
+            e.compressed = true;
+            e.ext.size = stored;
+        }
+    }
+    if(ret != 0){
+        fprintf(stderr, "%s: %s\n", inpath, strerror(ret));
+        parcel_close(in);
+        return 1;
+    }
+
+    for(Extent &e : extents){
+        e.ext.offset = off;
+        off += e.ext.size;
+    }
+    for(uint64_t i = 0; i < n; ++i){
+        nodes[i].offset = nodestart + i * PARCEL_NODE_SIZE;
+        if(nodes[i].type >= PARCEL_BLOB && nodeextent[i] != NO_EXTENT){
+            const Extent &e = extents[nodeextent[i]];
+            nodes[i].data.offset = e.ext.offset;
+            if(e.compressed)
+                nodes[i].extra |= PARCEL_EXTRA_COMPRESSED;
+        } else if(nodes[i].type >= PARCEL_BLOB){
+            nodes[i].data.offset = 0;
+        }
+    }
+
+    // Extent table, sorted by hash
+    std::vector<struct parcel_extent> table;
+    for(const Extent &e : extents)
+        table.push_back(e.ext);
+    std::sort(table.begin(), table.end(), hashLess);
+    uint64_t extenttable = off;
+    off += table.size() * PARCEL_EXTENT_ENTRY;
+
+    struct parcel_super sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = PARCEL_MAGIC;
+    sb.version = PARCEL_V2;
+    sb.flags = parcel_super(in)->flags & ~PARCEL_FLAG_SNAPSHOT;    // v2 has its index on disk
+    sb.treehead = linkTree(nodes, 0, n);
+    sb.tail = off;
+    memcpy(sb.rootid, parcel_super(in)->rootid, PARCEL_UID_SIZE);
+    sb.indexroot = levelstart[depth - 1];
+    sb.nodecount = n;
+    sb.nodestart = nodestart;
+    sb.indexdepth = depth;
+    sb.extenttable = extenttable;
+    sb.extentcount = table.size();
+
+    int fd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1){
+        fprintf(stderr, "%s: %s\n", outpath, strerror(errno));
+        parcel_close(in);
+        return 1;
+    }
+    Writer out(fd);
+
+    uint8_t super[PARCEL_BLOCK];
+    memset(super, 0, sizeof(super));
+    parcel_encode_super(&sb, super);
+    out.write(super, sizeof(super));
+
+    writeIndex(out, nodes, levelblocks, levelstart);
+
+    uint8_t data[PARCEL_NODE_SIZE];
+    for(uint64_t i = 0; i < n; ++i){
+        memset(data, 0, sizeof(data));
+        nodes[i].magic = PARCEL_TREE_MAGIC;
+        parcel_encode_treenode(&nodes[i], data);
+        out.write(data, sizeof(data));
+    }
+
+    // Copy each extent once
+    for(size_t k = 0; k < extents.size() && ret == 0; ++k){
+        if(extents[k].compressed){
+            ret = packExtent(in, &extents[k].src, extents[k].ends, &out);
+            continue;
+        }
+        if(extents[k].content){
+            out.write(extents[k].content->data(), extents[k].content->size());
+            continue;
+        }
+        const struct parcel_node &src = extents[k].src;
+        for(uint64_t pos = 0; pos < src.data.size; ){
+            ssize_t len = parcel_read(in, &src, buf.data(), buf.size(), pos);
+            if(len <= 0){
+                ret = len < 0 ? -len : EIO;
+                break;
+            }
+            out.write(buf.data(), len);
+            pos += len;
+        }
+    }
+
+    uint8_t entry[PARCEL_EXTENT_ENTRY];
+    for(const struct parcel_extent &ext : table){
+        parcel_encode_extent(&ext, entry);
+        out.write(entry, sizeof(entry));
+    }
+    out.flush();
+
+    if(ret == 0 && (out.failed() || fsync(fd) != 0))
+        ret = EIO;
+    close(fd);
+    parcel_close(in);
+
+    if(ret != 0){
+        fprintf(stderr, "%s: %s\n", outpath, strerror(ret));
+        return 1;
+    }
+    uint64_t shared = 0;
+    uint64_t stored = 0;
+    for(const Extent &e : extents){
+        shared += (e.ext.refs - 1) * e.src.data.size;
+        stored += e.ext.size;
+    }
+    printf("%lu nodes, %lu inline, %lu name indexes, index depth %d, %lu extents, %lu bytes deduplicated, %lu bytes\n",
+           (unsigned long)n, (unsigned long)inlined, (unsigned long)made.size(), depth, (unsigned long)extents.size(), (unsigned long)shared, (unsigned long)sb.tail);
+    if(compress)
+        printf("payload %lu bytes, %lu stored\n", (unsigned long)rawsize, (unsigned long)stored);
+    return 0;
+}
@@ -0,0 +1,271 @@
+#ifndef PARCELFORMAT_H
+#define PARCELFORMAT_H
+
+/* Userspace view of the Parcel on-disk format, see lkm/parcel.h.
+ * All integers are stored big endian at unaligned offsets.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PARCEL_MAGIC            0x5452eef5
+#define PARCEL_TREE_MAGIC       0x54524545
+#define PARCEL_FREE_MAGIC       0x66726565
+#define PARCEL_INDEX_MAGIC      0x54524958
+#define PARCEL_NAMEINDEX_MAGIC  0x54524e49
+
+#define PARCEL_UID_SIZE         16
+#define PARCEL_SUPER_SIZE       64
+#define PARCEL_NODE_SIZE        58
+#define PARCEL_FREE_SIZE        24
+
+/* Version 2 keeps the v1 superblock and tree nodes, and adds a static B+tree uid index in
+ * 4 KiB blocks. The first block holds only the superblock and its v2 extension, followed by
+ * the index blocks top level first, then all tree nodes in uid order, then payload data.
+ */
+#define PARCEL_V2               2
+#define PARCEL_BLOCK            4096
+#define PARCEL_EXT_OFFSET       64
+#define PARCEL_EXT_SIZE         64
+
+#define PARCEL_INDEX_HEADER     16
+#define PARCEL_INDEX_ENTRY      24
+#define PARCEL_INDEX_FANOUT     ((PARCEL_BLOCK - PARCEL_INDEX_HEADER) / PARCEL_INDEX_ENTRY)
+
+/* Payload extents are content addressed. The extent table after the payload data lists every
+ * extent once, sorted by the 128-bit hash of its content, with the number of nodes sharing it.
+ * An extent whose count drops to 0 is put on the free list.
+ */
+#define PARCEL_HASH_SIZE        16
+#define PARCEL_EXTENT_ENTRY     36
+
+/* Extents of nodes with PARCEL_EXTRA_COMPRESSED in extra are split into 64 KiB chunks that are
+ * LZ4 compressed independently, so a read only decompresses the chunks it touches. The extent
+ * starts with one be32 per chunk holding the end of that chunk, relative to the end of this
+ * table, followed by the chunks. A chunk whose stored size equals its raw size is stored raw.
+ * The node data size stays the uncompressed size, the extent table has the stored size.
+ */
+#define PARCEL_EXTRA_COMPRESSED 0x01
+#define PARCEL_CHUNK            65536
+
+/* Data of up to 16 bytes is stored inline in the payload of nodes with PARCEL_EXTRA_INLINE,
+ * with its length in the top bits of extra, so small values are served by the node read. The
+ * decoded data offset of an inline node is 0 and its size the inline length, clamped to
+ * PARCEL_INLINE_MAX like the kernel module does, since the field can hold up to 31.
+ */
+#define PARCEL_EXTRA_INLINE     0x02
+#define PARCEL_INLINE_MAX       16
+#define PARCEL_INLINE_SHIFT     3
+
+/* Lists with PARCEL_EXTRA_NAMEINDEX have a name index object, of type PARCEL_NAMEINDEX with
+ * the uid from parcel_nameindex_uid(). Its data is a 16 byte header (be32 magic, be32 entry
+ * count, be32 Bloom filter bytes, u8 Bloom hashes, u8 restart interval), the Bloom filter of
+ * all names, a be32 offset of every restart entry relative to the first entry, and the entries
+ * sorted by name. An entry is a u8 length of the prefix shared with the previous name, a u8
+ * suffix length, the suffix and the uid. Every interval-th entry is a restart and shares
+ * nothing. Bloom bits are set with parcel_bloom_bit() on the content hash of the name.
+ */
+#define PARCEL_EXTRA_NAMEINDEX  0x04
+#define PARCEL_NAMEINDEX_HEADER 16
+#define PARCEL_NAME_MAX         255
+
+/* v1 images have no uid index on disk, so one is built in memory at mount, and can be saved
+ * as an index snapshot for the next mount. The snapshot is written at tail, past all allocated
+ * space, and the superblock has PARCEL_FLAG_SNAPSHOT set while there is one. Its 32 byte header
+ * is a be32 magic, be32 CRC of the entries, be64 tree generation, be64 entry count, 4 reserved
+ * bytes and a be32 CRC of the header before it. The entries follow sorted by uid, a uid and a
+ * be64 node offset each like in index leaves. Allocating or freeing space moves tail or the
+ * free list and so changes parcel_tree_generation(), which makes the snapshot stale.
+ */
+#define PARCEL_FLAG_SNAPSHOT    0x01
+#define PARCEL_SNAPSHOT_MAGIC   0x5452534e
+#define PARCEL_SNAPSHOT_HEADER  32
+
+/* Out of line data of the types from PARCEL_BLOB up. A list is an array of uids, a file is a
+ * be16 name length and the name, followed by the file content.
+ */
+enum parcel_type {
+    PARCEL_NULL = 0,
+    PARCEL_BOOL,        //!< Boolean object. 1-bit.
+    PARCEL_UINT,        //!< Unsigned integer object. 64-bit.
+    PARCEL_SINT,        //!< Signed integer object. 64-bit.
+    PARCEL_FLOAT,       //!< Floating point number object. Double precision.
+    PARCEL_ZUID,        //!< UUID object.
+    PARCEL_BLOB,        //!< Binary blob object.
+    PARCEL_STRING,      //!< String object.
+    PARCEL_LIST,        //!< List object. Ordered list of UUIDs.
+    PARCEL_FILE,        //!< File object. Includes embedded filename and file content.
+    PARCEL_NAMEINDEX,   //!< Name index of a list object.
+};
+
+struct parcel_super {
+    uint32_t magic;
+    uint8_t version;
+    uint32_t flags;
+    uint64_t treehead;
+    uint64_t freehead;
+    uint64_t freetail;
+    uint64_t tail;
+    uint8_t rootid[PARCEL_UID_SIZE];
+    uint32_t crc;
+
+    // v2 extension
+    uint64_t indexroot;     //!< Root block of the uid index.
+    uint64_t nodecount;     //!< Tree nodes, all in the index.
+    uint64_t nodestart;     //!< Tree nodes are stored contiguously in uid order from here.
+    uint8_t indexdepth;     //!< Index levels, leaves are level 0.
+    uint64_t extenttable;   //!< Extent table, sorted by content hash.
+    uint64_t extentcount;
+    uint32_t extcrc;
+};
+
+struct parcel_node {
+    uint64_t offset;        //!< Offset of this node in the image.
+    uint32_t magic;
+    uint8_t uid[PARCEL_UID_SIZE];
+    uint64_t lnode;
+    uint64_t rnode;
+    uint8_t type;
+    uint8_t extra;
+    uint32_t crc;
+    uint8_t payload[16];
+
+    struct {
+        uint64_t offset;
+        uint64_t size;
+    } data;
+};
+
+struct parcel_free_node {
+    uint64_t offset;        //!< Offset of this free node in the image.
+    uint32_t magic;
+    uint64_t next;
+    uint64_t size;
+    uint32_t crc;
+};
+
+struct parcel_extent {
+    uint8_t hash[PARCEL_HASH_SIZE];
+    uint64_t offset;
+    uint64_t size;
+    uint32_t refs;          //!< Tree nodes pointing at this extent.
+};
+
+//! Incremental 128-bit content hash (MurmurHash3 x64 128, seed 0).
+struct parcel_hash {
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t len;
+    uint8_t tail[16];
+    size_t ntail;
+};
+
+/* Tree nodes decoded into one array per field, for scans over many nodes. Data offset and
+ * size are 0 for types without out of line data, like in struct parcel_node.
+ */
+struct parcel_node_batch {
+    size_t capacity;
+    size_t count;
+    uint8_t (*uid)[PARCEL_UID_SIZE];
+    uint64_t *lnode;
+    uint64_t *rnode;
+    uint8_t *type;
+    uint8_t *extra;
+    uint64_t *offset;
+    uint64_t *size;
+};
+
+static inline int parcel_is_inline(uint8_t type, uint8_t extra){
+    return type >= PARCEL_BLOB && (extra & PARCEL_EXTRA_INLINE);
+}
+
+static inline size_t parcel_inline_size(uint8_t extra){
+    size_t size = extra >> PARCEL_INLINE_SHIFT;
+    return size < PARCEL_INLINE_MAX ? size : PARCEL_INLINE_MAX;
+}
+
+static inline uint8_t parcel_inline_extra(uint8_t extra, size_t size){
+    return (extra & ((1 << PARCEL_INLINE_SHIFT) - 1)) | PARCEL_EXTRA_INLINE | size << PARCEL_INLINE_SHIFT;
+}
+
+static inline uint16_t parcel_get16(const uint8_t *p){
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t parcel_get32(const uint8_t *p){
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint64_t parcel_get64(const uint8_t *p){
+    return (uint64_t)parcel_get32(p) << 32 | parcel_get32(p + 4);
+}
+
+static inline void parcel_put16(uint8_t *p, uint16_t v){
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void parcel_put32(uint8_t *p, uint32_t v){
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline void parcel_put64(uint8_t *p, uint64_t v){
+    parcel_put32(p, v >> 32);
+    parcel_put32(p + 4, v);
+}
+
+//! CRC-32 (IEEE), as used for superblock, node and index block checksums.
+uint32_t parcel_crc32(uint32_t crc, const void *data, size_t len);
+
+void parcel_parse_super(struct parcel_super *sb, const uint8_t *data);
+void parcel_encode_super(const struct parcel_super *sb, uint8_t *data);
+//! CRC of the superblock fields that change when tree nodes are allocated or freed.
+uint32_t parcel_tree_generation(const struct parcel_super *sb);
+void parcel_parse_treenode(struct parcel_node *tn, const uint8_t *data);
+void parcel_encode_treenode(struct parcel_node *tn, uint8_t *data);
+
+void parcel_parse_freenode(struct parcel_free_node *fn, const uint8_t *data);
+void parcel_encode_freenode(struct parcel_free_node *fn, uint8_t *data);
+void parcel_parse_extent(struct parcel_extent *ext, const uint8_t *data);
+void parcel_encode_extent(const struct parcel_extent *ext, uint8_t *data);
+
+size_t parcel_lz4_compress(const uint8_t *src, size_t srcsize, uint8_t *dst, size_t dstsize);
+long parcel_lz4_decompress(const uint8_t *src, size_t srcsize, uint8_t *dst, size_t dstsize);
+
+void parcel_hash_init(struct parcel_hash *h);
+void parcel_hash_update(struct parcel_hash *h, const void *data, size_t len);
+void parcel_hash_final(struct parcel_hash *h, uint8_t *out);
+
+//! Bloom filter bit i of a name with content hash, double hashing over its two halves.
+static inline uint64_t parcel_bloom_bit(const uint8_t *hash, unsigned i, uint64_t bits){
+    return (parcel_get64(hash) + i * parcel_get64(hash + 8)) % bits;
+}
+
+//! Uid of the name index object of the list with listuid.
+void parcel_nameindex_uid(const uint8_t *listuid, uint8_t *uid);
+
+int parcel_batch_init(struct parcel_node_batch *batch, size_t capacity);
+void parcel_batch_free(struct parcel_node_batch *batch);
+
+/* Decode up to count contiguous encoded nodes into batch, replacing its contents. Returns the
+ * number decoded, which stops short at the first node with a bad magic.
+ */
+size_t parcel_parse_treenodes(struct parcel_node_batch *batch, const uint8_t *data, size_t count);
+
+/* Search an index block for uid. In a leaf returns the offset of the tree node, in an
+ * internal block the offset of the child block to descend into. Returns 0 if absent.
+ */
+uint64_t parcel_index_search(const uint8_t *block, const uint8_t *uid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PARCELFORMAT_H
@@ -0,0 +1,167 @@
+/* LZ4 block format codec for Parcel payload chunks. Output is standard LZ4 blocks, so images
+ * can be checked with any LZ4 implementation, but there is no frame format around them.
+ */
+
+#include "parcelformat.h"
+
+#include <string.h>
+
+namespace {
+
+const int MINMATCH = 4;
+const int MFLIMIT = 12;         // a match may not start in the last 12 bytes
+const int LASTLITERALS = 5;     // and the last 5 bytes are always literals
+const int HASH_BITS = 14;
+const int MAX_OFFSET = 65535;
+
+inline uint32_t read32(const uint8_t *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t hash4(uint32_t v){
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Length continuation bytes for lengths of 15 and up, returns false if out of space
+bool putLength(uint8_t *&op, const uint8_t *oend, size_t len){
+    for(; len >= 255; len -= 255){
+        if(op >= oend)
+            return false;
+        *op++ = 255;
+    }
+    if(op >= oend)
+        return false;
+    *op++ = len;
+    return true;
+}
+
+bool putSequence(uint8_t *&op, const uint8_t *oend, const uint8_t *lit, size_t nlit, size_t offset, size_t mlen){
+    if(op >= oend)
+        return false;
+    uint8_t *token = op++;
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if(nlit >= 15 && !putLength(op, oend, nlit - 15))
+        return false;
+    if((size_t)(oend - op) < nlit)
+        return false;
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    // The last sequence has literals only
+    if(mlen == 0)
+        return true;
+    if(oend - op < 2)
+        return false;
+    *op++ = offset;
+    *op++ = offset >> 8;
+    mlen -= MINMATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    return mlen < 15 || putLength(op, oend, mlen - 15);
+}
+
+}
+
+/* Greedy single pass compressor. Returns the compressed size, or 0 if the output would not fit
+ * in dstsize, in which case the caller stores the data raw.
+ */
+size_t parcel_lz4_compress(const uint8_t *src, size_t srcsize, uint8_t *dst, size_t dstsize){
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));    // positions are stored plus one, 0 is empty
+
+    const uint8_t *oend = dst + dstsize;
+    uint8_t *op = dst;
+    size_t anchor = 0;
+    size_t i = 0;
+
+    while(srcsize >= MFLIMIT && i + MFLIMIT <= srcsize){
+        uint32_t seq = read32(src + i);
+        uint32_t h = hash4(seq);
+        size_t ref = table[h];
+        table[h] = i + 1;
+
+        if(ref == 0 || i - (ref - 1) > MAX_OFFSET || read32(src + ref - 1) != seq){
+            ++i;
+            continue;
+        }
+        --ref;
+
+        size_t mlen = MINMATCH;
+        while(i + mlen < srcsize - LASTLITERALS && src[ref + mlen] == src[i + mlen])
+            ++mlen;
+        if(!putSequence(op, oend, src + anchor, i - anchor, i - ref, mlen))
+            return 0;
+        i += mlen;
+        anchor = i;
+    }
+
+    if(!putSequence(op, oend, src + anchor, srcsize - anchor, 0, 0))
+        return 0;
+    return op - dst;
+}
+
+/* Decompress a block, never reading or writing out of bounds. Returns the decompressed size,
+ * or -1 if the block is malformed or does not fit in dstsize.
+ */
+long parcel_lz4_decompress(const uint8_t *src, size_t srcsize, uint8_t *dst, size_t dstsize){
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + srcsize;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dstsize;
+
+    while(ip < iend){
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if(nlit == 15){
+            unsigned b;
+            do {
+                if(ip >= iend)
+                    return -1;
+                b = *ip++;
+                nlit += b;
+            } while(b == 255);
+        }
+        if((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit)
+            return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        // Block ends after the last literals
+        if(ip == iend)
+            break;
+
+        if(iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if(offset == 0 || offset > (size_t)(op - dst))
+            return -1;
+
+        size_t mlen = token & 15;
+        if(mlen == 15){
+            unsigned b;
+            do {
+                if(ip >= iend)
+                    return -1;
+                b = *ip++;
+                mlen += b;
+            } while(b == 255);
+        }
+        mlen += MINMATCH;
+        if((size_t)(oend - op) < mlen)
+            return -1;
+
+        // Matches may overlap their own output, so copy forward byte by byte when close
+        const uint8_t *match = op - offset;
+        if(offset >= mlen){
+            memcpy(op, match, mlen);
+            op += mlen;
+        } else {
+            for(size_t k = 0; k < mlen; ++k)
+                *op++ = match[k];
+        }
+    }
+    return op - dst;
+}
@@ -0,0 +1,323 @@
+/* io_uring read queue. Any thread may queue reads, one completion thread submits them in
+ * batches and calls the completion callbacks:
+ *
+ *  - read() prepares a submission queue entry under the lock, and wakes run() through the
+ *    eventfd only if it may be waiting, so a burst of reads costs one wakeup.
+ *  - run() submits everything prepared since its last pass and waits for completions in the
+ *    same io_uring_enter() call. A read of the eventfd is always queued, so new work or
+ *    shutdown completes it.
+ *  - Short reads are requeued for the rest, like readAt() loops on pread().
+ */
+
+#include "parceluring.h"
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+// One read may not ask for more than fits the 32-bit sqe length
+const size_t MAX_LEN = 1 << 30;
+
+inline int uringSetup(unsigned entries, struct io_uring_params *p){
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+inline int uringEnter(int fd, unsigned submit, unsigned wait, unsigned flags){
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+inline int uringRegister(int fd, unsigned op, const void *arg, unsigned count){
+    return syscall(__NR_io_uring_register, fd, op, arg, count);
+}
+
+}
+
+struct ParcelRing::Request {
+    Done done;
+    void *arg;
+    uint8_t *buf;
+    int index;                  //!< Registered buffer, or -1 for a malloc()ed one.
+    uint64_t off;
+    size_t size;
+    size_t got;
+    ssize_t result;
+};
+
+ParcelRing::ParcelRing() : _fd(-1), _file(-1), _wake(-1), _wakeValue(0), _depth(0), _fixedFile(false),
+        _sqMap(MAP_FAILED), _sqMapSize(0), _cqMap(MAP_FAILED), _cqMapSize(0), _sqes((io_uring_sqe *)MAP_FAILED),
+        _sqesSize(0), _pool(NULL), _poolSize(0), _bufsize(0),
+        _queued(0), _inflight(0), _sleeping(false), _wakeArmed(false), _stop(false){}
+
+ParcelRing *ParcelRing::create(int fd, unsigned depth, unsigned buffers, size_t bufsize){
+    ParcelRing *ring = new ParcelRing;
+    ring->_file = fd;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->_fd = uringSetup(depth, &p);
+    if(ring->_fd < 0)
+        goto fail;
+
+    // Reads of the eventfd need the poll driven reads of 5.7
+    if(!(p.features & IORING_FEAT_FAST_POLL)){
+        errno = ENOSYS;
+        goto fail;
+    }
+    ring->_depth = p.sq_entries;
+
+    ring->_sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->_cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        if(ring->_cqMapSize > ring->_sqMapSize)
+            ring->_sqMapSize = ring->_cqMapSize;
+        ring->_cqMapSize = 0;
+    }
+    ring->_sqMap = mmap(NULL, ring->_sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->_fd,
+                        IORING_OFF_SQ_RING);
+    if(ring->_sqMap == MAP_FAILED)
+        goto fail;
+    if(ring->_cqMapSize == 0)
+        ring->_cqMap = ring->_sqMap;
+    else {
+        ring->_cqMap = mmap(NULL, ring->_cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->_fd,
+                            IORING_OFF_CQ_RING);
+        if(ring->_cqMap == MAP_FAILED)
+            goto fail;
+    }
+    ring->_sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->_sqes = (io_uring_sqe *)mmap(NULL, ring->_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       ring->_fd, IORING_OFF_SQES);
+    if(ring->_sqes == MAP_FAILED)
+        goto fail;
+
+    {
+        uint8_t *sq = (uint8_t *)ring->_sqMap;
+        uint8_t *cq = (uint8_t *)ring->_cqMap;
+        ring->_sqHead = (unsigned *)(sq + p.sq_off.head);
+        ring->_sqTail = (unsigned *)(sq + p.sq_off.tail);
+        ring->_sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+        ring->_sqArray = (unsigned *)(sq + p.sq_off.array);
+        ring->_cqHead = (unsigned *)(cq + p.cq_off.head);
+        ring->_cqTail = (unsigned *)(cq + p.cq_off.tail);
+        ring->_cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+        ring->_cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    }
+
+    ring->_wake = eventfd(0, EFD_CLOEXEC);
+    if(ring->_wake < 0)
+        goto fail;
+
+    // Both registrations only save work per read, so the ring runs without them if they fail
+    ring->_fixedFile = uringRegister(ring->_fd, IORING_REGISTER_FILES, &fd, 1) == 0;
+
+    ring->_bufsize = bufsize;
+    if(buffers > 0 && bufsize > 0){
+        ring->_poolSize = buffers * bufsize;
+        void *pool = mmap(NULL, ring->_poolSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(pool != MAP_FAILED){
+            std::vector<struct iovec> iov(buffers);
+            for(unsigned i = 0; i < buffers; ++i){
+                iov[i].iov_base = (uint8_t *)pool + i * bufsize;
+                iov[i].iov_len = bufsize;
+            }
+            if(uringRegister(ring->_fd, IORING_REGISTER_BUFFERS, iov.data(), buffers) == 0){
+                ring->_pool = (uint8_t *)pool;
+                for(unsigned i = buffers; i > 0; --i)
+                    ring->_free.push_back(i - 1);
+            } else
+                munmap(pool, ring->_poolSize);
+        }
+    }
+
+    ring->_thread = std::thread(&ParcelRing::run, ring);
+    return ring;
+
+fail:
+    int err = errno;
+    delete ring;
+    errno = err;
+    return NULL;
+}
+
+ParcelRing::~ParcelRing(){
+    if(_thread.joinable()){
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _stop = true;
+            uint64_t one = 1;
+            if(write(_wake, &one, sizeof(one)) != sizeof(one))
+                abort();
+        }
+        _thread.join();
+    }
+
+    if(_pool != NULL)
+        munmap(_pool, _poolSize);
+    if(_sqes != MAP_FAILED)
+        munmap(_sqes, _sqesSize);
+    if(_cqMap != MAP_FAILED && _cqMap != _sqMap)
+        munmap(_cqMap, _cqMapSize);
+    if(_sqMap != MAP_FAILED)
+        munmap(_sqMap, _sqMapSize);
+    if(_wake >= 0)
+        close(_wake);
+    if(_fd >= 0)
+        close(_fd);
+}
+
+/* Prepare an entry for the rest of req, or the eventfd read if req is NULL. Only the kernel
+ * moves the head, so the ring is full when the tail is a whole ring ahead of it.
+ */
+bool ParcelRing::queue(Request *req){
+    unsigned tail = *_sqTail;
+    if(tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) > _sqMask)
+        return false;
+
+    io_uring_sqe *sqe = &_sqes[tail & _sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    if(req == NULL){
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = _wake;
+        sqe->addr = (uintptr_t)&_wakeValue;
+        sqe->len = sizeof(_wakeValue);
+        sqe->user_data = 0;
+        _wakeArmed = true;
+    } else {
+        size_t len = req->size - req->got;
+        sqe->opcode = req->index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = _fixedFile ? 0 : _file;
+        sqe->flags = _fixedFile ? IOSQE_FIXED_FILE : 0;
+        sqe->off = req->off + req->got;
+        sqe->addr = (uintptr_t)(req->buf + req->got);
+        sqe->len = len < MAX_LEN ? len : MAX_LEN;
+        sqe->buf_index = req->index >= 0 ? req->index : 0;
+        sqe->user_data = (uintptr_t)req;
+    }
+    _sqArray[tail & _sqMask] = tail & _sqMask;
+    __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++_queued;
+    return true;
+}
+
+bool ParcelRing::read(uint64_t off, size_t size, Done done, void *arg, bool background){
+    std::lock_guard<std::mutex> lock(_lock);
+
+    // Keep a ring entry for rearming the eventfd read, and never overflow the completion queue
+    if(_stop || _inflight + 1 >= (background ? _depth / 2 : _depth))
+        return false;
+
+    Request *req = new Request;
+    req->done = done;
+    req->arg = arg;
+    req->off = off;
+    req->size = size;
+    req->got = 0;
+    req->result = 0;
+    if(size <= _bufsize && !_free.empty()){
+        req->index = _free.back();
+        req->buf = _pool + req->index * _bufsize;
+        _free.pop_back();
+    } else {
+        req->index = -1;
+        req->buf = (uint8_t *)malloc(size > 0 ? size : 1);
+        if(req->buf == NULL){
+            delete req;
+            return false;
+        }
+    }
+
+    if(!queue(req)){
+        if(req->index >= 0)
+            _free.push_back(req->index);
+        else
+            free(req->buf);
+        delete req;
+        return false;
+    }
+    ++_inflight;
+
+    if(_sleeping){
+        _sleeping = false;
+        uint64_t one = 1;
+        if(write(_wake, &one, sizeof(one)) != sizeof(one))
+            abort();
+    }
+    return true;
+}
+
+void ParcelRing::run(){
+    std::vector<Request *> done;
+    std::unique_lock<std::mutex> lock(_lock);
+
+    queue(NULL);
+    while(!_stop || _inflight > 0 || _wakeArmed){
+        unsigned submit = _queued;
+        _queued = 0;
+        _sleeping = true;
+        lock.unlock();
+
+        int ret = uringEnter(_fd, submit, 1, IORING_ENTER_GETEVENTS);
+
+        lock.lock();
+        _sleeping = false;
+        if(ret < 0)
+            ret = 0;            // EINTR, or EAGAIN and EBUSY until completions are reaped
+        if((unsigned)ret < submit)
+            _queued += submit - ret;
+
+        unsigned head = *_cqHead;
+        unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+        for(; head != tail; ++head){
+            const io_uring_cqe *cqe = &_cqes[head & _cqMask];
+            Request *req = (Request *)(uintptr_t)cqe->user_data;
+            int res = cqe->res;
+
+            if(req == NULL){
+                _wakeArmed = false;
+                if(!_stop)
+                    queue(NULL);
+                continue;
+            }
+
+            if(res == -EINTR || res == -EAGAIN || (res > 0 && req->got + res < req->size)){
+                if(res > 0)
+                    req->got += res;
+                if(queue(req))
+                    continue;
+                res = -EIO;
+            }
+            if(res > 0)
+                req->got += res;
+            req->result = res < 0 || req->got < req->size ? -EIO : (ssize_t)req->size;
+            done.push_back(req);
+        }
+        __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+
+        if(done.empty())
+            continue;
+
+        // Callbacks may reply to FUSE or queue more reads, so they run without the lock
+        lock.unlock();
+        for(Request *req : done)
+            req->done(req->arg, req->buf, req->result);
+        lock.lock();
+
+        for(Request *req : done){
+            if(req->index >= 0)
+                _free.push_back(req->index);
+            else
+                free(req->buf);
+            delete req;
+        }
+        _inflight -= done.size();
+        done.clear();
+    }
+}
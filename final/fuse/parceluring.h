@@ -0,0 +1,81 @@
+#ifndef PARCELURING_H
+#define PARCELURING_H
+
+/* io_uring read queue for one file descriptor, used by the Parcel adapter for asynchronous
+ * payload reads. Talks to the kernel with the raw system calls, so it needs no liburing.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+class ParcelRing {
+public:
+    //! Called once per read from the completion thread, data is only valid during the call.
+    typedef void (*Done)(void *arg, const void *data, ssize_t result);
+
+    /* Set up a ring of depth entries reading from fd. The given number of buffers, bufsize
+     * bytes each, are registered with the kernel. Returns NULL and sets errno on failure.
+     */
+    static ParcelRing *create(int fd, unsigned depth, unsigned buffers, size_t bufsize);
+    //! Waits for reads in flight and stops the completion thread.
+    ~ParcelRing();
+
+    /* Queue a read of size bytes at off. Returns false if the ring is full, then done is not
+     * called and the caller should read synchronously. Background reads like readahead only
+     * get half of the ring, so they never hold up reads someone waits for.
+     */
+    bool read(uint64_t off, size_t size, Done done, void *arg, bool background = false);
+
+private:
+    struct Request;
+
+    ParcelRing();
+    bool queue(Request *req);
+    void run();
+
+    int _fd;                    //!< The ring.
+    int _file;                  //!< The image.
+    int _wake;                  //!< eventfd, read by the ring so submitters can wake run().
+    uint64_t _wakeValue;
+    unsigned _depth;
+    bool _fixedFile;
+
+    // Shared rings, see io_uring_setup(2)
+    void *_sqMap;
+    size_t _sqMapSize;
+    void *_cqMap;
+    size_t _cqMapSize;
+    io_uring_sqe *_sqes;
+    size_t _sqesSize;
+    unsigned *_sqHead;
+    unsigned *_sqTail;
+    unsigned _sqMask;
+    unsigned *_sqArray;
+    unsigned *_cqHead;
+    unsigned *_cqTail;
+    unsigned _cqMask;
+    io_uring_cqe *_cqes;
+
+    uint8_t *_pool;             //!< Registered buffers, _bufsize each.
+    size_t _poolSize;
+    size_t _bufsize;
+    std::vector<int> _free;     //!< Free registered buffers.
+
+    std::mutex _lock;           //!< Guards the submission ring and everything below.
+    unsigned _queued;           //!< Prepared but not yet submitted.
+    unsigned _inflight;         //!< Reads not completed yet, not counting the wake read.
+    bool _sleeping;             //!< run() may be waiting for completions.
+    bool _wakeArmed;
+    bool _stop;
+    std::thread _thread;
+};
+
+#endif // PARCELURING_H
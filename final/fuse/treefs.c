@@ -8,14 +8,18 @@
 
 /** @file
  *
- * minimal example filesystem using low-level API
+ * Read only TreeFS on a Parcel image, using the low-level API.
  *
- * Compile with:
+ * The root directory is the list object named by the superblock root id. List objects are
+ * directories of their members, file objects are regular files named by their embedded name,
+ * and other objects are regular files named by their uid in hex. Scalars read as text.
+ * Inode numbers are tree node offsets in the image. The root also holds the batch query
+ * control file, see treefsquery.h. File reads are queued on io_uring and answered from its
+ * completion thread, so a few workers keep many reads in flight. Sequential and strided reads
+ * of a file are read ahead into the adapter's chunk cache. v1 images get an in-memory uid
+ * index at mount, mapped from an index snapshot when -o snapshot saved a current one.
  *
- *     gcc -Wall hello_ll.c `pkg-config fuse3 --cflags --libs` -o hello_ll
- *
- * ## Source code ##
- * \include hello_ll.c
+ *     treefs [options] <image> <mountpoint>
  */
 
 #define FUSE_USE_VERSION 30
@@ -25,38 +29,173 @@
 #include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "parceladapter.h"
+#include "treefsquery.h"
+
+#define TREEFS_TIMEOUT 1.0
 
-static const char *hello_str = "Hello World!\n";
-static const char *hello_name = "hello";
+// No tree node is stored this close to the superblock, so this can not collide
+#define TREEFS_QUERY_INO 2
 
 struct treefs_data {
     const char *dev;
+    struct parcel *pc;
+    struct parcel_node root;
+    unsigned long cache;        //!< Decompressed chunk cache in MiB.
+    unsigned long depth;        //!< io_uring queue depth, 0 reads synchronously.
+    unsigned long readahead;    //!< Largest readahead window in KiB, 0 disables readahead.
+    int snapshot;               //!< Save the uid index of v1 images on clean unmount.
+};
+
+// Registered io_uring buffers, one per queue entry up to the largest FUSE read
+#define TREEFS_READ_BUFFER (128 << 10)
+
+// Readahead windows start at the largest FUSE read and double while the pattern holds
+#define TREEFS_RA_MIN (128 << 10)
+
+//! An open file, the node and name header are only read once.
+struct treefs_file {
+    struct parcel_node node;
+    uint64_t skip;
+
+    // Access pattern of the reads so far
+    pthread_mutex_t lock;
+    uint64_t last;              //!< Offset of the previous read.
+    uint64_t next;              //!< End of the previous read.
+    int64_t stride;             //!< Distance between the previous two reads.
+    uint64_t ahead;             //!< Streams are read ahead up to here.
+    size_t window;              //!< 0 after random reads.
 };
 
 static struct treefs_data tfs_data;
 
-static int hello_stat(fuse_ino_t ino, struct stat *stbuf)
+static fuse_ino_t node_ino(const struct parcel_node *node)
 {
-    stbuf->st_ino = ino;
-    switch (ino) {
-    case 1:
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
+    return node->offset == tfs_data.root.offset ? FUSE_ROOT_ID : node->offset;
+}
+
+static int node_get(fuse_ino_t ino, struct parcel_node *node)
+{
+    if (ino == FUSE_ROOT_ID) {
+        *node = tfs_data.root;
+        return 0;
+    }
+    return parcel_node_at(tfs_data.pc, ino, node);
+}
+
+static void uid_hex(const uint8_t *uid, char *buf)
+{
+    for (int i = 0; i < PARCEL_UID_SIZE; ++i)
+        sprintf(buf + i * 2, "%02x", uid[i]);
+}
+
+static int node_name(const struct parcel_node *node, char *name, uint64_t *skip)
+{
+    return parcel_node_name(tfs_data.pc, node, name, skip);
+}
+
+//! Scalars read as one line of text, returns its length.
+static size_t render_scalar(const struct parcel_node *node, char *buf, size_t size)
+{
+    uint64_t v = parcel_get64(node->payload);
+    double d;
+    int n = 0;
+
+    switch (node->type) {
+    case PARCEL_BOOL:
+        n = snprintf(buf, size, "%s\n", node->payload[0] ? "true" : "false");
+        break;
+    case PARCEL_UINT:
+        n = snprintf(buf, size, "%" PRIu64 "\n", v);
+        break;
+    case PARCEL_SINT:
+        n = snprintf(buf, size, "%" PRId64 "\n", (int64_t) v);
+        break;
+    case PARCEL_FLOAT:
+        memcpy(&d, &v, sizeof(d));
+        n = snprintf(buf, size, "%.17g\n", d);
         break;
+    case PARCEL_ZUID:
+        uid_hex(node->payload, buf);
+        strcpy(buf + PARCEL_UID_SIZE * 2, "\n");
+        n = PARCEL_UID_SIZE * 2 + 1;
+        break;
+    }
+    return n;
+}
+
+static void query_stat(struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = TREEFS_QUERY_INO;
+    stbuf->st_mode = S_IFREG | 0666;
+    stbuf->st_nlink = 1;
+}
 
-    case 2:
+static int treefs_stat(const struct parcel_node *node, struct stat *stbuf)
+{
+    char name[PARCEL_NAME_MAX + 1];
+    char text[64];
+    uint64_t skip;
+
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = node_ino(node);
+    if (node->type == PARCEL_LIST) {
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+        stbuf->st_size = node->data.size;
+    } else if (node->type >= PARCEL_BLOB) {
+        if (node_name(node, name, &skip) != 0)
+            return -EIO;
         stbuf->st_mode = S_IFREG | 0444;
         stbuf->st_nlink = 1;
-        stbuf->st_size = strlen(hello_str);
-        break;
+        stbuf->st_size = node->data.size - skip;
+    } else {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = render_scalar(node, text, sizeof(text));
+    }
+    return 0;
+}
 
-    default:
-        return -1;
+/* Call fn for every member of a list node with its name. Members missing from the image are
+ * skipped. Returns 0, the nonzero value from fn, or a negative errno.
+ */
+static int for_each_child(const struct parcel_node *dir,
+                          int (*fn)(const struct parcel_node *child, const char *name, void *arg),
+                          void *arg)
+{
+    uint8_t uids[256 * PARCEL_UID_SIZE];
+    char name[PARCEL_NAME_MAX + 1];
+    struct parcel_node child;
+    uint64_t skip;
+
+    for (uint64_t pos = 0; pos + PARCEL_UID_SIZE <= dir->data.size; ) {
+        ssize_t n = parcel_read(tfs_data.pc, dir, uids, sizeof(uids), pos);
+        if (n < PARCEL_UID_SIZE)
+            return n < 0 ? n : -EIO;
+        n -= n % PARCEL_UID_SIZE;
+        pos += n;
+
+        for (ssize_t i = 0; i < n; i += PARCEL_UID_SIZE) {
+            int ret = parcel_find(tfs_data.pc, uids + i, &child);
+            if (ret == -ENOENT)
+                continue;
+            if (ret == 0)
+                ret = node_name(&child, name, &skip);
+            if (ret == 0)
+                ret = fn(&child, name, arg);
+            if (ret != 0)
+                return ret;
+        }
     }
     return 0;
 }
@@ -65,15 +204,34 @@ static void treefs_ll_getattr(fuse_req_t req,
                               fuse_ino_t ino,
                               struct fuse_file_info *fi)
 {
+    struct parcel_node node;
     struct stat stbuf;
 
     (void) fi;
 
-    memset(&stbuf, 0, sizeof(stbuf));
-    if (hello_stat(ino, &stbuf) == -1)
+    if (ino == TREEFS_QUERY_INO) {
+        query_stat(&stbuf);
+        fuse_reply_attr(req, &stbuf, TREEFS_TIMEOUT);
+    } else if (node_get(ino, &node) != 0)
         fuse_reply_err(req, ENOENT);
+    else if (treefs_stat(&node, &stbuf) != 0)
+        fuse_reply_err(req, EIO);
     else
-        fuse_reply_attr(req, &stbuf, 1.0);
+        fuse_reply_attr(req, &stbuf, TREEFS_TIMEOUT);
+}
+
+struct lookup_arg {
+    const char *name;
+    struct parcel_node node;
+};
+
+static int lookup_child(const struct parcel_node *child, const char *name, void *arg)
+{
+    struct lookup_arg *la = arg;
+    if (strcmp(name, la->name) != 0)
+        return 0;
+    la->node = *child;
+    return 1;
 }
 
 static void treefs_ll_lookup(fuse_req_t req,
@@ -81,18 +239,58 @@ static void treefs_ll_lookup(fuse_req_t req,
                              const char *name)
 {
     struct fuse_entry_param e;
+    struct parcel_node dir;
+    struct lookup_arg la;
+    int ret;
 
-    if (parent != 1 || strcmp(name, hello_name) != 0)
+    if (node_get(parent, &dir) != 0) {
         fuse_reply_err(req, ENOENT);
-    else {
-        memset(&e, 0, sizeof(e));
-        e.ino = 2;
-        e.attr_timeout = 1.0;
-        e.entry_timeout = 1.0;
-        hello_stat(e.ino, &e.attr);
+        return;
+    }
+    if (dir.type != PARCEL_LIST) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
 
+    memset(&e, 0, sizeof(e));
+    e.attr_timeout = TREEFS_TIMEOUT;
+    e.entry_timeout = TREEFS_TIMEOUT;
+    if (parent == FUSE_ROOT_ID && strcmp(name, TREEFS_QUERY_NAME) == 0) {
+        query_stat(&e.attr);
+        e.ino = TREEFS_QUERY_INO;
         fuse_reply_entry(req, &e);
+        return;
     }
+
+    // Indexed lists answer from the index, others are scanned. A bad index falls back to a scan.
+    ret = -EINVAL;
+    if (dir.extra & PARCEL_EXTRA_NAMEINDEX) {
+        ret = parcel_dir_lookup(tfs_data.pc, &dir, name, &la.node);
+        if (ret == 0)
+            ret = 1;
+        else if (ret == -ENOENT) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+    }
+    la.name = name;
+    if (ret < 0)
+        ret = for_each_child(&dir, lookup_child, &la);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    if (ret == 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (treefs_stat(&la.node, &e.attr) != 0) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    e.ino = e.attr.st_ino;
+    fuse_reply_entry(req, &e);
 }
 
 struct dirbuf {
@@ -128,38 +326,322 @@ static int reply_buf_limited(fuse_req_t req,
         return fuse_reply_buf(req, NULL, 0);
 }
 
+struct readdir_arg {
+    fuse_req_t req;
+    struct dirbuf *b;
+};
+
+static int readdir_child(const struct parcel_node *child, const char *name, void *arg)
+{
+    struct readdir_arg *ra = arg;
+    dirbuf_add(ra->req, ra->b, name, node_ino(child));
+    return 0;
+}
+
+// Directory listings are built once on opendir and kept in fi->fh until releasedir
+static void treefs_ll_opendir(fuse_req_t req,
+                              fuse_ino_t ino,
+                              struct fuse_file_info *fi)
+{
+    struct parcel_node dir;
+    struct readdir_arg ra;
+    struct dirbuf *b;
+    int ret;
+
+    if (node_get(ino, &dir) != 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (dir.type != PARCEL_LIST) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    b = calloc(1, sizeof(*b));
+    if (b == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    dirbuf_add(req, b, ".", ino);
+    dirbuf_add(req, b, "..", FUSE_ROOT_ID);
+    if (ino == FUSE_ROOT_ID)
+        dirbuf_add(req, b, TREEFS_QUERY_NAME, TREEFS_QUERY_INO);
+    ra.req = req;
+    ra.b = b;
+    ret = for_each_child(&dir, readdir_child, &ra);
+    if (ret != 0) {
+        free(b->p);
+        free(b);
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    fi->fh = (uintptr_t) b;
+    fuse_reply_open(req, fi);
+}
+
 static void treefs_ll_readdir(fuse_req_t req,
                               fuse_ino_t ino,
                               size_t size,
                               off_t off,
                               struct fuse_file_info *fi)
 {
-    (void) fi;
+    struct dirbuf *b = (struct dirbuf *) (uintptr_t) fi->fh;
 
-    if (ino != 1)
-        fuse_reply_err(req, ENOTDIR);
-    else {
-        struct dirbuf b;
+    (void) ino;
+
+    reply_buf_limited(req, b->p, b->size, off, size);
+}
+
+static void treefs_ll_releasedir(fuse_req_t req,
+                                 fuse_ino_t ino,
+                                 struct fuse_file_info *fi)
+{
+    struct dirbuf *b = (struct dirbuf *) (uintptr_t) fi->fh;
+
+    (void) ino;
+
+    free(b->p);
+    free(b);
+    fuse_reply_err(req, 0);
+}
 
-        memset(&b, 0, sizeof(b));
-        dirbuf_add(req, &b, ".", 1);
-        dirbuf_add(req, &b, "..", 1);
-        dirbuf_add(req, &b, hello_name, 2);
-        reply_buf_limited(req, b.p, b.size, off, size);
-        free(b.p);
+struct query {
+    pthread_mutex_t lock;   //!< Held across building and replying, threads may share the fd.
+    uint8_t *uids;
+    size_t size;            //!< Bytes of uids written.
+    char *resp;
+    size_t respsize;
+    size_t capacity;
+    int done;               //!< Response built, the next write starts a new query.
+};
+
+// Returns space for size more bytes at the end of the response, or NULL
+static char *query_reserve(struct query *q, size_t size)
+{
+    if (q->respsize + size > q->capacity) {
+        size_t capacity = q->capacity ? q->capacity : 4096;
+        while (capacity < q->respsize + size)
+            capacity *= 2;
+        char *p = realloc(q->resp, capacity);
+        if (p == NULL)
+            return NULL;
+        q->resp = p;
+        q->capacity = capacity;
     }
+    q->respsize += size;
+    return q->resp + q->respsize - size;
+}
+
+//! Value length of a node in a query response.
+static size_t query_length(const struct parcel_node *node)
+{
+    switch (node->type) {
+    case PARCEL_BOOL:
+        return 1;
+    case PARCEL_UINT:
+    case PARCEL_SINT:
+    case PARCEL_FLOAT:
+        return 8;
+    case PARCEL_ZUID:
+        return PARCEL_UID_SIZE;
+    case PARCEL_NULL:
+        return 0;
+    }
+    return node->data.size;
+}
+
+//! Build the response to the uids written so far. Returns 0 or a negative errno.
+static int query_run(struct query *q)
+{
+    size_t count = q->size / PARCEL_UID_SIZE;
+    struct parcel_node node;
+    char *rec;
+
+    q->respsize = 0;
+    if ((rec = query_reserve(q, TREEFS_QUERY_HEADER)) == NULL)
+        return -ENOMEM;
+    parcel_put32((uint8_t *) rec, TREEFS_QUERY_MAGIC);
+    parcel_put32((uint8_t *) rec + 4, count);
+
+    for (size_t i = 0; i < count; ++i) {
+        int ret = parcel_find(tfs_data.pc, q->uids + i * PARCEL_UID_SIZE, &node);
+        size_t len = ret == 0 ? query_length(&node) : 0;
+        uint8_t status = -ret;
+
+        if (ret == 0 && len > TREEFS_QUERY_VALUE_MAX)
+            status = EFBIG;
+        else if (ret == 0 && q->respsize + TREEFS_QUERY_RECORD + len > TREEFS_QUERY_RESPONSE_MAX)
+            status = ENOSPC;
+        if (status != 0)
+            len = 0;
+
+        if ((rec = query_reserve(q, TREEFS_QUERY_RECORD + len)) == NULL)
+            return -ENOMEM;
+        rec[0] = ret == 0 ? node.type : PARCEL_NULL;
+        rec[1] = status;
+        parcel_put32((uint8_t *) rec + 2, len);
+        rec += TREEFS_QUERY_RECORD;
+
+        if (len == 0)
+            continue;
+        if (node.type < PARCEL_BLOB)
+            memcpy(rec, node.payload, len);
+        else if (parcel_read(tfs_data.pc, &node, rec, len, 0) != (ssize_t) len) {
+            // The record stays, with the error and without its value
+            q->respsize -= len;
+            rec[-TREEFS_QUERY_RECORD + 1] = EIO;
+            parcel_put32((uint8_t *) rec - TREEFS_QUERY_RECORD + 2, 0);
+        }
+    }
+    q->done = 1;
+    return 0;
+}
+
+static void query_write(fuse_req_t req,
+                        struct query *q,
+                        const char *buf,
+                        size_t size,
+                        off_t off)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->done) {
+        q->size = 0;
+        q->respsize = 0;
+        q->done = 0;
+    }
+    if (off < 0 || off + size > TREEFS_QUERY_MAX * PARCEL_UID_SIZE) {
+        fuse_reply_err(req, EFBIG);
+        goto out;
+    }
+    if (off + size > q->size) {
+        uint8_t *p = realloc(q->uids, off + size);
+        if (p == NULL) {
+            fuse_reply_err(req, ENOMEM);
+            goto out;
+        }
+        memset(p + q->size, 0, off + size - q->size);
+        q->uids = p;
+        q->size = off + size;
+    }
+    memcpy(q->uids + off, buf, size);
+    fuse_reply_write(req, size);
+out:
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void query_read(fuse_req_t req,
+                       struct query *q,
+                       size_t size,
+                       off_t off)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->done)
+        ret = q->size % PARCEL_UID_SIZE != 0 ? -EINVAL : query_run(q);
+    if (ret != 0)
+        fuse_reply_err(req, -ret);
+    else
+        reply_buf_limited(req, q->resp, q->respsize, off, size);
+    pthread_mutex_unlock(&q->lock);
 }
 
 static void treefs_ll_open(fuse_req_t req,
                            fuse_ino_t ino,
                            struct fuse_file_info *fi)
 {
-    if (ino != 2)
+    struct parcel_node node;
+    char name[PARCEL_NAME_MAX + 1];
+    struct treefs_file *f;
+
+    if (ino == TREEFS_QUERY_INO) {
+        struct query *q = calloc(1, sizeof(*q));
+        if (q == NULL) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+        pthread_mutex_init(&q->lock, NULL);
+        fi->fh = (uintptr_t) q;
+        fi->direct_io = 1;
+        fuse_reply_open(req, fi);
+    } else if (node_get(ino, &node) != 0)
+        fuse_reply_err(req, ENOENT);
+    else if (node.type == PARCEL_LIST)
         fuse_reply_err(req, EISDIR);
     else if ((fi->flags & 3) != O_RDONLY)
         fuse_reply_err(req, EACCES);
-    else
+    else if ((f = calloc(1, sizeof(*f))) == NULL)
+        fuse_reply_err(req, ENOMEM);
+    else if (node.type >= PARCEL_BLOB && node_name(&node, name, &f->skip) != 0) {
+        free(f);
+        fuse_reply_err(req, EIO);
+    } else {
+        f->node = node;
+        pthread_mutex_init(&f->lock, NULL);
+        fi->fh = (uintptr_t) f;
+        // The image never changes under us
+        fi->keep_cache = 1;
         fuse_reply_open(req, fi);
+    }
+}
+
+/* Read ahead of a stream of reads. Reads within a window of where the previous one ended are
+ * sequential, and keep the range up to a window past the current read in flight once half of
+ * it has been consumed. Reads a repeated distance apart are strided, and prefetch the next
+ * window's worth of records. Anything else is random and collapses the window. The window
+ * doubles on every read that fits the pattern, up to the readahead option.
+ * Readahead goes through whole chunks of PARCEL_CHUNK bytes.
+ */
+static void file_readahead(struct treefs_file *f, uint64_t off, size_t size)
+{
+    size_t max = tfs_data.readahead << 10;
+    size_t near;
+    int64_t stride;
+
+    if (max == 0 || f->node.type < PARCEL_BLOB)
+        return;
+
+    pthread_mutex_lock(&f->lock);
+    // Workers may pick up the kernel's reads of a stream slightly out of order
+    near = f->window > size ? f->window : size;
+    stride = (int64_t) (off - f->last);
+    if (off + near >= f->next && off <= f->next + near) {
+        f->window = f->window == 0 ? TREEFS_RA_MIN : f->window * 2 > max ? max : f->window * 2;
+        if (f->ahead < off + size + f->window / 2) {
+            uint64_t from = f->ahead > off + size ? f->ahead : off + size;
+            f->ahead = off + size + f->window;
+            parcel_readahead(tfs_data.pc, &f->node, from + f->skip, f->ahead - from);
+        }
+    } else if (stride != 0 && stride == f->stride) {
+        f->window = f->window == 0 ? TREEFS_RA_MIN : f->window * 2 > max ? max : f->window * 2;
+        // Each record costs at least a chunk, those already cached or in flight are skipped
+        size_t unit = size > PARCEL_CHUNK ? size : PARCEL_CHUNK;
+        for (size_t k = 1; k * unit <= f->window; ++k) {
+            int64_t pos = (int64_t) off + (int64_t) k * stride;
+            if (pos < 0)
+                break;
+            parcel_readahead(tfs_data.pc, &f->node, pos + f->skip, size);
+        }
+    } else {
+        f->window = 0;
+        f->ahead = 0;
+    }
+    f->stride = stride;
+    f->last = off;
+    f->next = off + size;
+    pthread_mutex_unlock(&f->lock);
+}
+
+// Replies from the io_uring completion thread, or in the handler for synchronous reads
+static void read_done(void *arg, const void *data, ssize_t result)
+{
+    fuse_req_t req = arg;
+
+    if (result < 0)
+        fuse_reply_err(req, -result);
+    else
+        fuse_reply_buf(req, data, result);
 }
 
 static void treefs_ll_read(fuse_req_t req,
@@ -168,31 +650,112 @@ static void treefs_ll_read(fuse_req_t req,
                            off_t off,
                            struct fuse_file_info *fi)
 {
-    (void) fi;
+    struct treefs_file *f = (struct treefs_file *) (uintptr_t) fi->fh;
+    char text[64];
+
+    if (ino == TREEFS_QUERY_INO) {
+        query_read(req, (struct query *) (uintptr_t) fi->fh, size, off);
+        return;
+    }
+    if (f->node.type < PARCEL_BLOB) {
+        reply_buf_limited(req, text, render_scalar(&f->node, text, sizeof(text)), off, size);
+        return;
+    }
+
+    /* The reply is deferred to the completion, so this worker can take the next request.
+     * Once it may be sent the file can be released, so f is not touched after the read is
+     * queued.
+     */
+    file_readahead(f, off, size);
+    parcel_read_async(tfs_data.pc, &f->node, size, off + f->skip, read_done, req);
+}
+
+static void treefs_ll_write(fuse_req_t req,
+                            fuse_ino_t ino,
+                            const char *buf,
+                            size_t size,
+                            off_t off,
+                            struct fuse_file_info *fi)
+{
+    if (ino != TREEFS_QUERY_INO)
+        fuse_reply_err(req, EROFS);
+    else
+        query_write(req, (struct query *) (uintptr_t) fi->fh, buf, size, off);
+}
 
-    assert(ino == 2);
-    reply_buf_limited(req, hello_str, strlen(hello_str), off, size);
+static void treefs_ll_release(fuse_req_t req,
+                              fuse_ino_t ino,
+                              struct fuse_file_info *fi)
+{
+    if (ino == TREEFS_QUERY_INO) {
+        struct query *q = (struct query *) (uintptr_t) fi->fh;
+        pthread_mutex_destroy(&q->lock);
+        free(q->uids);
+        free(q->resp);
+        free(q);
+    } else {
+        struct treefs_file *f = (struct treefs_file *) (uintptr_t) fi->fh;
+        pthread_mutex_destroy(&f->lock);
+        free(f);
+    }
+    fuse_reply_err(req, 0);
 }
 
 static struct fuse_lowlevel_ops treefs_ll_oper = {
     .lookup     = treefs_ll_lookup,
     .getattr    = treefs_ll_getattr,
+    .opendir    = treefs_ll_opendir,
     .readdir    = treefs_ll_readdir,
+    .releasedir = treefs_ll_releasedir,
     .open       = treefs_ll_open,
     .read       = treefs_ll_read,
+    .write      = treefs_ll_write,
+    .release    = treefs_ll_release,
 };
 
+static const struct fuse_opt treefs_opts[] = {
+    { "cache=%lu", offsetof(struct treefs_data, cache), 0 },
+    { "uring=%lu", offsetof(struct treefs_data, depth), 0 },
+    { "readahead=%lu", offsetof(struct treefs_data, readahead), 0 },
+    { "snapshot", offsetof(struct treefs_data, snapshot), 1 },
+    FUSE_OPT_END
+};
+
+// The first argument that is not an option is the image, the next one the mountpoint
+static int treefs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    struct treefs_data *td = data;
+
+    (void) outargs;
+
+    if (key == FUSE_OPT_KEY_NONOPT && td->dev == NULL) {
+        td->dev = strdup(arg);
+        return 0;
+    }
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct fuse_session *se;
     struct fuse_cmdline_opts opts;
     int ret = -1;
+    int err;
 
+    tfs_data.cache = 16;
+    tfs_data.depth = 128;
+    tfs_data.readahead = 4096;
+    if (fuse_opt_parse(&args, &tfs_data, treefs_opts, treefs_opt_proc) != 0)
+        return 1;
     if (fuse_parse_cmdline(&args, &opts) != 0)
         return 1;
     if (opts.show_help) {
-        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        printf("usage: %s [options] <image> <mountpoint>\n\n", argv[0]);
+        printf("    -o cache=N             decompressed chunk cache in MiB (default 16)\n");
+        printf("    -o uring=N             io_uring queue depth, 0 to disable (default 128)\n");
+        printf("    -o readahead=N         largest readahead window in KiB, 0 to disable (default 4096)\n");
+        printf("    -o snapshot            save the uid index of v1 images on clean unmount\n");
         fuse_cmdline_help();
         fuse_lowlevel_help();
         ret = 0;
@@ -203,6 +766,28 @@ int main(int argc, char *argv[])
         ret = 0;
         goto err_out1;
     }
+    if (tfs_data.dev == NULL || opts.mountpoint == NULL) {
+        fprintf(stderr, "usage: %s [options] <image> <mountpoint>\n", argv[0]);
+        goto err_out1;
+    }
+
+    tfs_data.pc = tfs_data.snapshot ? parcel_open_rw(tfs_data.dev) : parcel_open(tfs_data.dev);
+    if (tfs_data.pc == NULL) {
+        fprintf(stderr, "%s: %s\n", tfs_data.dev, strerror(errno));
+        goto err_out1;
+    }
+    parcel_set_cache(tfs_data.pc, tfs_data.cache << 20);
+
+    // v1 images without a current snapshot are walked here, by one thread per CPU
+    err = parcel_load_index(tfs_data.pc, 0);
+    if (err < 0)
+        fprintf(stderr, "%s: index: %s, lookups walk the tree\n", tfs_data.dev, strerror(-err));
+
+    if (parcel_find(tfs_data.pc, parcel_super(tfs_data.pc)->rootid, &tfs_data.root) != 0 ||
+        tfs_data.root.type != PARCEL_LIST) {
+        fprintf(stderr, "%s: no root list object\n", tfs_data.dev);
+        goto err_out1;
+    }
 
     se = fuse_session_new(&args, &treefs_ll_oper, sizeof(treefs_ll_oper), NULL);
     if (se == NULL)
@@ -216,21 +801,38 @@ int main(int argc, char *argv[])
 
     fuse_daemonize(opts.foreground);
 
+    // The completion thread would not survive the fork in fuse_daemonize()
+    if (tfs_data.depth > 0) {
+        err = parcel_start_async(tfs_data.pc, tfs_data.depth, tfs_data.depth, TREEFS_READ_BUFFER);
+        if (err != 0)
+            fprintf(stderr, "%s: io_uring: %s, reading synchronously\n", tfs_data.dev, strerror(-err));
+    }
+
     /* Block until ctrl+c or fusermount -u */
     if (opts.singlethread)
         ret = fuse_session_loop(se);
     else
         ret = fuse_session_loop_mt(se, opts.clone_fd);
 
+    // Deferred replies need the session
+    parcel_stop_async(tfs_data.pc);
+
+    if (ret == 0 && tfs_data.snapshot) {
+        err = parcel_save_index(tfs_data.pc);
+        if (err != 0)
+            fprintf(stderr, "%s: index snapshot: %s\n", tfs_data.dev, strerror(-err));
+    }
     fuse_session_unmount(se);
 err_out3:
     fuse_remove_signal_handlers(se);
 err_out2:
     fuse_session_destroy(se);
 err_out1:
+    if (tfs_data.pc != NULL)
+        parcel_close(tfs_data.pc);
+    free((char *) tfs_data.dev);
     free(opts.mountpoint);
     fuse_opt_free_args(&args);
 
     return ret ? 1 : 0;
 }
-
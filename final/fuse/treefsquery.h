@@ -0,0 +1,31 @@
+#ifndef TREEFSQUERY_H
+#define TREEFSQUERY_H
+
+/* Batch typed-value queries on a TreeFS mount, through the control file TREEFS_QUERY_NAME in
+ * the root directory. Open it read write (without O_TRUNC), write a packed array of 16 byte
+ * uids, then read the response from offset 0. Writing again starts a new query. One query at
+ * a time per open file.
+ *
+ * The response is big endian like the image: a be32 TREEFS_QUERY_MAGIC and a be32 record
+ * count, then one record per uid in request order. A record is a u8 type (enum parcel_type),
+ * a u8 status (0 or an errno), a be32 length, and the value:
+ *
+ *      PARCEL_BOOL         1 byte
+ *      PARCEL_UINT/SINT    8 bytes
+ *      PARCEL_FLOAT        8 bytes, IEEE 754 double
+ *      PARCEL_ZUID         16 bytes
+ *      PARCEL_BLOB and up  the object data, a file with its name header
+ *
+ * Missing uids get ENOENT, data longer than TREEFS_QUERY_VALUE_MAX gets EFBIG, and values past
+ * TREEFS_QUERY_RESPONSE_MAX bytes of response get ENOSPC, all with length 0.
+ */
+
+#define TREEFS_QUERY_NAME           ".query"
+#define TREEFS_QUERY_MAGIC          0x54525152
+#define TREEFS_QUERY_HEADER         8
+#define TREEFS_QUERY_RECORD         6
+#define TREEFS_QUERY_MAX            65536           //!< Uids per query.
+#define TREEFS_QUERY_VALUE_MAX      65536
+#define TREEFS_QUERY_RESPONSE_MAX   (64 << 20)
+
+#endif // TREEFSQUERY_H
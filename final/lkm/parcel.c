@@ -15,6 +15,17 @@ void parcel_parse_super(struct treefs_super *sb, const char *data){
     sb->tail =      be64_to_cpu(*(__be64 *)(data + 36));
     memcpy(sb->rootid, data + 44, 16);
     sb->crc =       be32_to_cpu(*(__be32 *)(data + 60));
+
+    if(sb->version >= TREEFS_V2){
+        const char *ext = data + TREEFS_EXT_OFFSET;
+        sb->indexroot =     be64_to_cpu(*(__be64 *)(ext));
+        sb->nodecount =     be64_to_cpu(*(__be64 *)(ext + 8));
+        sb->nodestart =     be64_to_cpu(*(__be64 *)(ext + 16));
+        sb->indexdepth =    ext[24];
+        sb->extenttable =   be64_to_cpu(*(__be64 *)(ext + 32));
+        sb->extentcount =   be64_to_cpu(*(__be64 *)(ext + 40));
+        sb->extcrc =        be32_to_cpu(*(__be32 *)(ext + 60));
+    }
 }
 
 void parcel_parse_treenode(struct treefs_tree_node *tn, const char *data){
@@ -27,8 +38,77 @@ void parcel_parse_treenode(struct treefs_tree_node *tn, const char *data){
     tn->crc =       be32_to_cpu(*(__be32 *)(data + 38));
     memcpy(tn->payload, data + 42, 16);
 
-    if(tn->type >= BLOBOBJ){
+    if(tn->type >= BLOBOBJ && (tn->extra & TREEFS_EXTRA_INLINE)){
+        tn->data.offset =   0;
+        tn->data.size =     TREEFS_INLINE_SIZE(tn->extra);
+    } else if(tn->type >= BLOBOBJ){
         tn->data.offset =   be64_to_cpu(*(__be64 *)(tn->payload));
         tn->data.size=      be64_to_cpu(*(__be64 *)(tn->payload + 8));
     }
 }
+
+void parcel_parse_index(struct treefs_index_block *ib, const char *data){
+    ib->magic =     be32_to_cpu(*(__be32 *)(data));
+    ib->count =     be16_to_cpu(*(__be16 *)(data + 4));
+    ib->level =     data[6];
+    ib->crc =       be32_to_cpu(*(__be32 *)(data + 8));
+}
+
+/* Search an index block for uid. In a leaf returns the offset of the tree node, in an
+ * internal block the offset of the child block covering uid. Returns 0 if absent.
+ */
+u64 parcel_index_search(const struct treefs_index_block *ib, const char *data, const u8 *uid){
+    const char *ent = data + TREEFS_INDEX_HEADER;
+    unsigned lo = 0;
+    unsigned hi = ib->count;
+
+    // First entry greater than uid, the one before it covers uid
+    while(lo < hi){
+        unsigned mid = (lo + hi) / 2;
+        if(memcmp(ent + mid * TREEFS_INDEX_ENTRY, uid, 16) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo == 0)
+        return 0;
+
+    ent += (lo - 1) * TREEFS_INDEX_ENTRY;
+    if(ib->level == 0 && memcmp(ent, uid, 16) != 0)
+        return 0;
+    return be64_to_cpu(*(__be64 *)(ent + 16));
+}
+
+/* Decode up to count contiguous nodes into nb, stopping at the first bad magic. Returns the
+ * number decoded. The loop has no calls and stores each field to its own array, so the byte
+ * swaps compile to bswap/movbe without the per node padding of treefs_tree_node.
+ */
+unsigned parcel_parse_treenodes(struct treefs_node_batch *nb, const char *data, unsigned count){
+    unsigned i;
+    if(count > nb->capacity)
+        count = nb->capacity;
+
+    for(i = 0; i < count; ++i){
+        const char *p = data + i * TREEFS_NODE_SIZE;
+        u64 mask;
+        if(be32_to_cpu(*(__be32 *)(p)) != TREEFS_TREE_MAGIC)
+            break;
+
+        memcpy(nb->uid[i], p + 4, 16);
+        nb->lnode[i] =  be64_to_cpu(*(__be64 *)(p + 20));
+        nb->rnode[i] =  be64_to_cpu(*(__be64 *)(p + 28));
+        nb->type[i] =   p[36];
+        nb->extra[i] =  p[37];
+
+        // Types without out of line data get a zero extent, without a branch
+        mask = (u8)p[36] >= BLOBOBJ ? ~0ULL : 0;
+        nb->offset[i] = be64_to_cpu(*(__be64 *)(p + 42)) & mask;
+        nb->size[i] =   be64_to_cpu(*(__be64 *)(p + 50)) & mask;
+        if(mask && (p[37] & TREEFS_EXTRA_INLINE)){
+            nb->offset[i] = 0;
+            nb->size[i] = TREEFS_INLINE_SIZE(p[37]);
+        }
+    }
+    nb->count = i;
+    return i;
+}
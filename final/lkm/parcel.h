@@ -2,6 +2,43 @@
 static unsigned long TREEFS_MAGIC       = 0x5452eef5;
 static unsigned long TREEFS_TREE_MAGIC  = 0x54524545;
 static unsigned long TREEFS_FREE_MAGIC  = 0x66726565;
+static unsigned long TREEFS_INDEX_MAGIC = 0x54524958;
+
+/* Version 2 adds a static B+tree uid index in 4 KiB blocks, so a lookup reads one block per
+ * index level instead of one node per level of the lnode/rnode tree. Block 0 holds the
+ * superblock and its v2 extension, followed by the index top level first, then all tree nodes
+ * contiguously in uid order.
+ */
+#define TREEFS_V2               2
+#define TREEFS_NODE_SIZE        58
+#define TREEFS_EXT_OFFSET       64
+#define TREEFS_INDEX_BLOCK      4096
+#define TREEFS_INDEX_HEADER     16
+#define TREEFS_INDEX_ENTRY      24      // uid, then node or child block offset
+#define TREEFS_INDEX_FANOUT     ((TREEFS_INDEX_BLOCK - TREEFS_INDEX_HEADER) / TREEFS_INDEX_ENTRY)
+
+/* Payload extents of nodes with this extra bit are LZ4 compressed in 64 KiB chunks behind a
+ * be32 table of chunk ends. Only the userspace adapter reads them so far.
+ */
+#define TREEFS_EXTRA_COMPRESSED 0x01
+#define TREEFS_CHUNK            65536
+
+/* Data of up to 16 bytes may be stored in the payload itself, with its length in the top bits
+ * of extra. Such nodes decode with a data offset of 0 and the inline length as size.
+ */
+#define TREEFS_EXTRA_INLINE     0x02
+#define TREEFS_INLINE_MAX       16
+#define TREEFS_INLINE_SHIFT     3
+// The length field can hold up to 31, longer lengths are clamped
+#define TREEFS_INLINE_SIZE(extra) min_t(unsigned int, (u8)(extra) >> TREEFS_INLINE_SHIFT, TREEFS_INLINE_MAX)
+
+// Lists with a sorted name index object and Bloom filter, built by parcelconv
+#define TREEFS_EXTRA_NAMEINDEX  0x04
+
+/* Superblock flag of v1 images with an index snapshot at tail, for the userspace adapter. The
+ * snapshot lies past all allocated space, so the module can ignore it.
+ */
+#define TREEFS_FLAG_SNAPSHOT    0x01
 
 enum treefs_object_types {
     NULLOBJ = 0,
@@ -14,6 +51,7 @@ enum treefs_object_types {
     STRINGOBJ,      //!< String object.
     LISTOBJ,        //!< List object. Ordered list of UUIDs.
     FILEOBJ,        //!< File object. Includes embedded filename and file content.
+    NAMEIDXOBJ,     //!< Name index of a list object, for directory lookups.
 };
 
 struct treefs_super {
@@ -27,6 +65,15 @@ struct treefs_super {
     u8 rootid[16];
     u32 crc;
 
+    // v2 extension
+    u64 indexroot;      //!< Root block of the uid index.
+    u64 nodecount;
+    u64 nodestart;      //!< First of nodecount contiguous tree nodes.
+    u8 indexdepth;      //!< Index levels, leaves are level 0.
+    u64 extenttable;    //!< Shared payload extents with reference counts, by content hash.
+    u64 extentcount;
+    u32 extcrc;
+
     unsigned block_size;
 };
 
@@ -46,6 +93,21 @@ struct treefs_tree_node {
     } data;
 };
 
+/* Tree nodes decoded into one array per field, for scans over runs of nodes. Data offset and
+ * size are 0 for types without out of line data.
+ */
+struct treefs_node_batch {
+    unsigned capacity;
+    unsigned count;
+    u8 (*uid)[16];
+    u64 *lnode;
+    u64 *rnode;
+    u8 *type;
+    u8 *extra;
+    u64 *offset;
+    u64 *size;
+};
+
 struct treefs_free_node {
     u32 magic;
     u64 next;
@@ -53,4 +115,15 @@ struct treefs_free_node {
     u32 crc;
 };
 
+struct treefs_index_block {
+    u32 magic;
+    u16 count;
+    u8 level;
+    u32 crc;
+};
+
 void parcel_parse_super(struct treefs_super *sb, const char *data);
+void parcel_parse_treenode(struct treefs_tree_node *tn, const char *data);
+unsigned parcel_parse_treenodes(struct treefs_node_batch *nb, const char *data, unsigned count);
+void parcel_parse_index(struct treefs_index_block *ib, const char *data);
+u64 parcel_index_search(const struct treefs_index_block *ib, const char *data, const u8 *uid);
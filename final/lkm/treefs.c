@@ -6,6 +6,7 @@
 #include <linux/string.h>
 #include <linux/uuid.h>
 #include <linux/crypto.h>
+#include <linux/crc32.h>
 
 #include "treefs.h"
 
@@ -56,6 +57,84 @@ static struct inode_operations treefs_dir_inode_ops = {
     .lookup = treefs_lookup,
 };
 
+// Copy len bytes from byte offset off of the device, which may span blocks
+static int treefs_read_bytes(struct super_block *sb, u64 off, char *buf, unsigned len){
+    while(len > 0){
+        unsigned boff = off & (sb->s_blocksize - 1);
+        unsigned n = min_t(unsigned, len, sb->s_blocksize - boff);
+        struct buffer_head *bh = sb_bread(sb, off >> sb->s_blocksize_bits);
+        if(!bh){
+            pr_err(TFS_LOG "failed reading block %llu\n", off >> sb->s_blocksize_bits);
+            return -EIO;
+        }
+        memcpy(buf, bh->b_data + boff, n);
+        brelse(bh);
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int treefs_read_node(struct super_block *sb, u64 off, struct treefs_tree_node *tn){
+    char data[TREEFS_NODE_SIZE];
+    if(treefs_read_bytes(sb, off, data, TREEFS_NODE_SIZE))
+        return -EIO;
+    parcel_parse_treenode(tn, data);
+    if(tn->magic != TREEFS_TREE_MAGIC){
+        pr_err(TFS_LOG "bad tree node magic at %llu\n", off);
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Find the tree node for uid. v2 images descend the uid index, one block read per level.
+ * Older images walk the lnode/rnode tree, one dependent node read per level.
+ */
+static int treefs_find_node(struct super_block *sb, const u8 *uid, struct treefs_tree_node *tn){
+    struct treefs_super *trsb = TREEFS_SB(sb);
+    u64 off;
+    int cmp;
+
+    if(trsb->version >= TREEFS_V2){
+        struct treefs_index_block ib;
+        struct buffer_head *bh;
+        int level;
+
+        off = trsb->indexroot;
+        for(level = trsb->indexdepth - 1; level >= 0; --level){
+            // Index blocks are block aligned
+            bh = sb_bread(sb, off >> sb->s_blocksize_bits);
+            if(!bh)
+                return -EIO;
+            parcel_parse_index(&ib, bh->b_data);
+            if(ib.magic != TREEFS_INDEX_MAGIC || ib.level != level){
+                pr_err(TFS_LOG "bad index block at %llu\n", off);
+                brelse(bh);
+                return -EIO;
+            }
+            off = parcel_index_search(&ib, bh->b_data, uid);
+            brelse(bh);
+            if(off == 0)
+                return -ENOENT;
+        }
+        if(treefs_read_node(sb, off, tn))
+            return -EIO;
+        return memcmp(tn->uid, uid, 16) == 0 ? 0 : -EIO;
+    }
+
+    off = trsb->treehead;
+    while(off != 0){
+        if(treefs_read_node(sb, off, tn))
+            return -EIO;
+        cmp = memcmp(uid, tn->uid, 16);
+        if(cmp == 0)
+            return 0;
+        off = cmp < 0 ? tn->lnode : tn->rnode;
+    }
+    return -ENOENT;
+}
+
 static struct inode *treefs_inode_get(struct super_block *sb, u8 *id){
     struct treefs_super *trsb = TREEFS_SB(sb);
     struct buffer_head *bh;
@@ -64,6 +143,9 @@ static struct inode *treefs_inode_get(struct super_block *sb, u8 *id){
 
     inode = sb->s_op->alloc_inode(sb);
 
+    ti = TREEFS_IN(inode);
+    if(treefs_find_node(sb, id, &ti->tn))
+        pr_err(TFS_LOG "no tree node for inode\n");
 
     if(S_ISREG(inode->i_mode)){
         inode->i_fop = &treefs_file_ops;
@@ -72,7 +154,6 @@ static struct inode *treefs_inode_get(struct super_block *sb, u8 *id){
         inode->i_fop = &treefs_dir_ops;
     }
 
-    ti = TREEFS_IN(inode);
     memcpy(ti->tn.uid, id, 16);
 
     return inode;
@@ -121,6 +202,11 @@ static void treefs_init_sb(struct treefs_super *trsb, char *data){
     parcel_parse_super(trsb, data);
     if(trsb->magic != TREEFS_MAGIC)
         pr_err(TFS_LOG "bad super magic\n");
+    // A damaged v2 extension leaves the lnode/rnode tree, which v2 images keep
+    if(trsb->version >= TREEFS_V2 && trsb->extcrc != ~crc32_le(~0, data + TREEFS_EXT_OFFSET, 60)){
+        pr_err(TFS_LOG "bad index header, using tree lookups\n");
+        trsb->version = 1;
+    }
     trsb->block_size = TREEFS_BLOCK_SIZE;
 }
 